@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "unity.h"
+#include "esp_event.h"
+#include "power_management.h"
+#include "power_management_jobs.h"
+
+#define DAY_MS (24ULL * 60 * 60 * 1000)
+
+static volatile bool _button_pressed = false;
+static volatile int _runs = 0;
+
+static void noop() {}
+
+static void inputs(power_management_inputs_t * inputs) {
+    inputs->button_pressed = _button_pressed;
+    inputs->charger_connected = false;
+    inputs->woken_up = false;
+}
+
+static void job(void * arg) {
+    _runs++;
+}
+
+static void test_simulate_rejects_invalid_config() {
+    power_management_job_config_t jobs[] = {
+        { .name = "zero", .period_ms = 0, .cb = job },
+    };
+    power_management_jobs_sim_result_t result;
+
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, power_management_jobs_simulate(jobs, 1, DAY_MS, &result));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, power_management_jobs_simulate(NULL, 1, DAY_MS, &result));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, power_management_jobs_simulate(jobs, 1, 0, &result));
+}
+
+static void test_simulate_without_tolerance_shares_exact_wakeups() {
+    power_management_job_config_t jobs[] = {
+        { .name = "sensor", .period_ms = 60000, .cb = job },
+        { .name = "report", .period_ms = 90000, .cb = job },
+    };
+    power_management_jobs_sim_result_t result;
+
+    TEST_ASSERT_EQUAL(ESP_OK, power_management_jobs_simulate(jobs, 2, DAY_MS, &result));
+
+    // 1440 + 960 wake-ups, every 3 minutes both jobs are due at once
+    TEST_ASSERT_EQUAL_UINT32(1920, result.wakes_uncoalesced);
+    TEST_ASSERT_EQUAL_UINT32(1920, result.wakes_coalesced);
+}
+
+static void test_simulate_with_tolerance_coalesces_wakeups() {
+    power_management_job_config_t jobs[] = {
+        { .name = "sensor", .period_ms = 60000, .tolerance_ms = 30000, .cb = job },
+        { .name = "report", .period_ms = 90000, .tolerance_ms = 45000, .cb = job },
+    };
+    power_management_jobs_sim_result_t result;
+
+    TEST_ASSERT_EQUAL(ESP_OK, power_management_jobs_simulate(jobs, 2, DAY_MS, &result));
+
+    TEST_ASSERT_EQUAL_UINT32(1920, result.wakes_uncoalesced);
+    // The report job always rides on the sensor wake-ups, the last sensor deadline falls past the day
+    TEST_ASSERT_EQUAL_UINT32(1439, result.wakes_coalesced);
+}
+
+static void test_registered_job_runs_on_period() {
+    power_management_job_config_t config = { .name = "sensor", .period_ms = 5000, .tolerance_ms = 1000, .cb = job };
+    uint64_t delay_ms;
+
+    TEST_ASSERT_EQUAL(ESP_OK, power_management_job_register(&config, NULL));
+
+    for (int i = 0; i < 200; i++) {
+        power_management_time_warp_step(100);
+    }
+
+    // 20 s of the virtual time with the device kept active by the lock
+    TEST_ASSERT_EQUAL(4, _runs);
+    TEST_ASSERT_EQUAL(ESP_OK, power_management_jobs_next_wakeup(&delay_ms));
+    TEST_ASSERT_LESS_OR_EQUAL(5000 + 1000, delay_ms);
+}
+
+void app_main() {
+    esp_event_loop_create_default();
+
+    power_management_set_setup_cb(noop);
+    power_management_set_loop_cb(noop);
+    power_management_set_sleep_cb(noop);
+    power_management_set_reboot_cb(noop);
+    power_management_set_shutdown_cb(noop);
+    power_management_set_off_charger_setup_cb(noop);
+    power_management_set_off_charger_loop_cb(noop);
+    power_management_set_inputs_cb(inputs);
+
+    power_management_time_warp_set(true);
+    power_management_init();
+
+    // Turning the device on by the click and keeping it active, so the idle timeout does not put it to sleep
+    _button_pressed = true;
+    power_management_time_warp_step(200);
+    _button_pressed = false;
+    power_management_time_warp_step(100);
+    power_management_active_lock_acquire();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_simulate_rejects_invalid_config);
+    RUN_TEST(test_simulate_without_tolerance_shares_exact_wakeups);
+    RUN_TEST(test_simulate_with_tolerance_coalesces_wakeups);
+    RUN_TEST(test_registered_job_runs_on_period);
+    exit(UNITY_END());
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "unity.h"
+#include "esp_event.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "power_management.h"
+#include "power_management_radio.h"
+
+static volatile bool _button_pressed = false;
+static volatile int _sent = 0;
+static power_management_radio_stub_t _stub = { 0 };
+
+static void noop() {}
+
+static void inputs(power_management_inputs_t * inputs) {
+    inputs->button_pressed = _button_pressed;
+    inputs->charger_connected = false;
+    inputs->woken_up = false;
+}
+
+static void send(void * arg) {
+    _sent++;
+}
+
+static esp_err_t op(void * arg) {
+    return ESP_FAIL;
+}
+
+static void advance(uint64_t ms) {
+    for (uint64_t t = 0; t < ms; t += 10) {
+        power_management_time_warp_step(10);
+    }
+}
+
+// The deferred sends and the modem-sleep switches follow the state in the other tasks
+static bool wait_sent(int sent) {
+    for (int i = 0; i < 100 && _sent != sent; i++) {
+        vTaskDelay(1);
+    }
+
+    return _sent == sent;
+}
+
+static bool wait_modem_sleep(bool modem_sleep) {
+    for (int i = 0; i < 100 && _stub.modem_sleep != modem_sleep; i++) {
+        vTaskDelay(1);
+    }
+
+    return _stub.modem_sleep == modem_sleep;
+}
+
+static void test_idle_device_defers_sends() {
+    power_management_radio_backend_t backend = power_management_radio_stub_backend(&_stub);
+    TEST_ASSERT_EQUAL(ESP_OK, power_management_radio_init(&backend));
+
+    TEST_ASSERT_EQUAL(POWER_MANAGEMENT_STATE_DEV_IDLE, power_management_get_state());
+    TEST_ASSERT_TRUE(wait_modem_sleep(true));
+
+    TEST_ASSERT_EQUAL(ESP_OK, power_management_radio_defer(send, NULL));
+    TEST_ASSERT_EQUAL(0, _sent);
+}
+
+static void test_operation_runs_deferred_sends() {
+    int op_id;
+
+    TEST_ASSERT_EQUAL(ESP_OK, power_management_radio_op_begin("upload", 1000, &op_id));
+    advance(100);
+
+    TEST_ASSERT_EQUAL(POWER_MANAGEMENT_STATE_DEV_ACTIVE, power_management_get_state());
+    TEST_ASSERT_TRUE(wait_modem_sleep(false));
+    TEST_ASSERT_TRUE(wait_sent(1));
+
+    TEST_ASSERT_EQUAL(ESP_OK, power_management_radio_op_end(op_id));
+    advance(100);
+    TEST_ASSERT_EQUAL(0, power_management_active_lock_count());
+}
+
+static void test_operation_timeout_releases_lock() {
+    int op_id;
+
+    TEST_ASSERT_EQUAL(ESP_OK, power_management_radio_op_begin("stuck", 1000, &op_id));
+    advance(100);
+    TEST_ASSERT_EQUAL(1, power_management_active_lock_count());
+
+    advance(1000);
+    TEST_ASSERT_EQUAL(0, power_management_active_lock_count());
+    TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, power_management_radio_op_end(op_id));
+
+    advance(100);
+    TEST_ASSERT_EQUAL(POWER_MANAGEMENT_STATE_DEV_IDLE, power_management_get_state());
+    TEST_ASSERT_TRUE(wait_modem_sleep(true));
+}
+
+static void test_operation_run_keeps_result() {
+    TEST_ASSERT_EQUAL(ESP_FAIL, power_management_radio_op_run("failing", op, NULL));
+    advance(100);
+    TEST_ASSERT_EQUAL(0, power_management_active_lock_count());
+}
+
+void app_main() {
+    esp_event_loop_create_default();
+
+    power_management_set_setup_cb(noop);
+    power_management_set_loop_cb(noop);
+    power_management_set_sleep_cb(noop);
+    power_management_set_reboot_cb(noop);
+    power_management_set_shutdown_cb(noop);
+    power_management_set_off_charger_setup_cb(noop);
+    power_management_set_off_charger_loop_cb(noop);
+    power_management_set_inputs_cb(inputs);
+
+    power_management_time_warp_set(true);
+    power_management_init();
+
+    // Turning the device on by the click, it goes idle after the idle timeout
+    _button_pressed = true;
+    advance(200);
+    _button_pressed = false;
+    advance(3500);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_idle_device_defers_sends);
+    RUN_TEST(test_operation_runs_deferred_sends);
+    RUN_TEST(test_operation_timeout_releases_lock);
+    RUN_TEST(test_operation_run_keeps_result);
+    exit(UNITY_END());
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "unity.h"
+#include "esp_event.h"
+#include "power_management.h"
+#include "power_management_trace.h"
+
+#define DAY_MS (24ULL * 60 * 60 * 1000)
+#define UNLOCK_MS (50 * DAY_MS)
+
+// The trace as recorded by power_management_trace_start() from the power-on: the header, the click turning the device on,
+// the active lock held for 50 days, past the 32 low bits of the timestamps, and the idle timeout putting the device to sleep
+static const power_management_trace_record_t _trace[] = {
+    { .timestamp_ms = 0, .type = POWER_MANAGEMENT_TRACE_RECORD_HEADER, .id = POWER_MANAGEMENT_STATE_INIT, .value = 0 },
+    { .timestamp_ms = 0, .type = POWER_MANAGEMENT_TRACE_RECORD_REQUEST, .id = POWER_MANAGEMENT_REQUEST_TYPE_IDLE_INACTIVITY_TIME_SET, .value = 30000 },
+    {
+        .timestamp_ms = 0,
+        .type = POWER_MANAGEMENT_TRACE_RECORD_REQUEST,
+        .id = POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_EXPIRED_ACTION_SET,
+        .value = POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_SLEEP,
+    },
+    { .timestamp_ms = 0, .type = POWER_MANAGEMENT_TRACE_RECORD_INPUTS, .value = POWER_MANAGEMENT_TRACE_INPUT_BUTTON_PRESSED },
+    { .timestamp_ms = 300, .type = POWER_MANAGEMENT_TRACE_RECORD_INPUTS, .value = 0 },
+    { .timestamp_ms = 5000, .type = POWER_MANAGEMENT_TRACE_RECORD_REQUEST, .id = POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_LOCK },
+    {
+        .timestamp_ms = (uint32_t)UNLOCK_MS,
+        .timestamp_ms_hi = UNLOCK_MS >> 32,
+        .type = POWER_MANAGEMENT_TRACE_RECORD_REQUEST,
+        .id = POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_UNLOCK,
+    },
+};
+
+static power_management_replay_transition_t _timeline[16];
+static power_management_replay_result_t _result;
+static esp_err_t _replay_err;
+
+static void test_replay_timeline() {
+    static const power_management_replay_transition_t expected[] = {
+        { 0, POWER_MANAGEMENT_STATE_INIT },
+        { 0, POWER_MANAGEMENT_STATE_SETUP },
+        { 3000, POWER_MANAGEMENT_STATE_DEV_IDLE },
+        { 5000, POWER_MANAGEMENT_STATE_DEV_ACTIVE },
+        { UNLOCK_MS, POWER_MANAGEMENT_STATE_DEV_IDLE },
+        { UNLOCK_MS + 30001, POWER_MANAGEMENT_STATE_SLEEP_PREPARE },
+    };
+
+    TEST_ASSERT_EQUAL(ESP_OK, _replay_err);
+    TEST_ASSERT_EQUAL(sizeof(expected) / sizeof(expected[0]), _result.timeline_count);
+
+    for (size_t i = 0; i < _result.timeline_count; i++) {
+        TEST_ASSERT_EQUAL_UINT64(expected[i].timestamp_ms, _timeline[i].timestamp_ms);
+        TEST_ASSERT_EQUAL(expected[i].state, _timeline[i].state);
+    }
+
+    TEST_ASSERT_EQUAL(POWER_MANAGEMENT_STATE_SLEEP_PREPARE, _result.final_state);
+}
+
+static void test_replay_residency() {
+    // Credited up to the transitions, not to the end of the steps they happened in
+    TEST_ASSERT_EQUAL_UINT64(3000, _result.residency_ms[POWER_MANAGEMENT_STATE_SETUP]);
+    TEST_ASSERT_EQUAL_UINT64(2000 + 30001, _result.residency_ms[POWER_MANAGEMENT_STATE_DEV_IDLE]);
+    TEST_ASSERT_EQUAL_UINT64(UNLOCK_MS - 5000, _result.residency_ms[POWER_MANAGEMENT_STATE_DEV_ACTIVE]);
+
+    uint64_t total_ms = 0;
+    for (int state = 0; state < POWER_MANAGEMENT_STATE_MAX; state++) {
+        total_ms += _result.residency_ms[state];
+    }
+    TEST_ASSERT_EQUAL_UINT64(_result.duration_ms, total_ms);
+}
+
+void app_main() {
+    esp_event_loop_create_default();
+
+    power_management_replay_config_t config = {
+        .step_ms = 10,
+        .tail_ms = 60000,
+        .timeline = _timeline,
+        .timeline_max = sizeof(_timeline) / sizeof(_timeline[0]),
+    };
+
+    _replay_err = power_management_replay(_trace, sizeof(_trace) / sizeof(_trace[0]), &config, &_result);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_replay_timeline);
+    RUN_TEST(test_replay_residency);
+    exit(UNITY_END());
+}
@@ -4,6 +4,7 @@
 #include "power_management_defs.h"
 #include "esp_err.h"
 #include "esp_event.h"
+#include "freertos/FreeRTOS.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -83,6 +84,18 @@ void power_management_set_charger_connected_cb(bool (*cb)());
  */
 void power_management_set_device_woken_up_cb(bool (*cb)());
 
+/**
+ * @brief Set the callback to read all the inputs at once
+ * 
+ * Can be set instead of button_cb, charger_connected_cb and device_woken_up_cb.
+ * Useful when the inputs share one bus transaction (e.g. GPIO expander over I2C):
+ * the callback fills button_pressed, charger_connected and woken_up of the snapshot.
+ * 
+ * Whichever callbacks are set, the inputs are read once per POWER_MANAGEMENT_INPUTS_SAMPLE_PERIOD_MS
+ * and the snapshot is shared by the button and power management tasks.
+ */
+void power_management_set_inputs_cb(void (*cb)(power_management_inputs_t * inputs));
+
 /**
  * @brief Set the callback for loop interaction with PMIC
  * 
@@ -93,6 +106,76 @@ void power_management_set_device_woken_up_cb(bool (*cb)());
  */
 void power_management_set_loop_cb(void (*cb)());
 
+/**
+ * The callbacks that are optional to set.
+ */
+
+/**
+ * @brief Set the callback for light sleep
+ * 
+ * The callback is being executed right before the device goes to light sleep.
+ * Useful for the wake-up sources setting (e.g. GPIO wake-up on button press) and peripherals suspending.
+ * After the wake-up, the DEVICE_LIGHT_SLEEP_WAKEUP event is emitted.
+ */
+void power_management_set_light_sleep_cb(void (*cb)());
+
+/**
+ * @brief Set the time source in milliseconds
+ * 
+ * By default, the 64-bit esp_timer is used.
+ * Useful to replace the time source in the tests, e.g. on Linux host. Set NULL to restore the default one.
+ */
+void power_management_set_time_source_cb(uint64_t (*cb)());
+
+/**
+ * @brief Get the time in milliseconds used by power management daemon for all the timers
+ */
+uint64_t power_management_millis();
+
+/**
+ * @brief Enable or disable the time-warp mode
+ * 
+ * In time-warp mode the time used by power management daemon is virtual, 
+ * it starts from the current time and goes only when it's advanced by power_management_time_warp_advance().
+ * The delays of power management daemon (e.g. in SETUP or before the sleep) wait for the virtual time too.
+ * 
+ * Useful for the accelerated tests: the button, idle and other timers expire as soon as the test advances the time,
+ * so the days of device behaviour can be simulated in minutes.
+ */
+void power_management_time_warp_set(bool enable);
+
+/**
+ * @brief Advance the virtual time in time-warp mode
+ *
+ * The tasks pick the new time up within a tick, so the test waits for them, e.g. by vTaskDelay(2).
+ */
+void power_management_time_warp_advance(uint64_t ms);
+
+/**
+ * @brief Advance the virtual time in time-warp mode and run one loop of the button and power management tasks
+ *
+ * Returns once both tasks have handled the new time, the button task first,
+ * so the test needs no real-time sleeps between the steps. The events are delivered by the event loop asynchronously.
+ * A delay of power management daemon (e.g. in SETUP) takes as many steps as its virtual time.
+ *
+ * @return ESP_ERR_INVALID_STATE if time-warp mode is disabled, power management is not started or its tasks are stopped
+ */
+esp_err_t power_management_time_warp_step(uint64_t ms);
+
+/**
+ * @brief Get the last inputs snapshot without reading the inputs
+ */
+esp_err_t power_management_inputs_get(power_management_inputs_t * inputs);
+
+/**
+ * @brief Request the inputs to be read on the next sample without waiting for the sample period
+ * 
+ * Useful to call from the button or charger interrupt handler. Both versions wake the button task up to sample the inputs,
+ * the ISR version sets task_unblocked if the button task is to be yielded to.
+ */
+void power_management_inputs_sample_request();
+void power_management_inputs_sample_request_from_isr(BaseType_t * task_unblocked);
+
 /**
  * @brief Emits the power management event
  * 
@@ -130,6 +213,36 @@ esp_err_t power_management_deregister_event_handler(
                                                             )
                                             );
 
+/**
+ * @brief Subscribes the handler to the set of events
+ * 
+ * The handler is called in the default event loop task for every event in the mask with the given context pointer.
+ * The handlers of the same event are called in the order of priority, the highest first,
+ * and in the order of subscription for the same priority.
+ * The subscribers of every event are resolved at the subscription, so the event is dispatched without search.
+ * Up to POWER_MANAGEMENT_SUBSCRIBERS_MAX subscriptions can be active.
+ * The subscriptions made before power_management_init() are dispatched after it,
+ * the default event loop must be created before power_management_init().
+ * 
+ * Usage:
+ * 
+ *  power_management_subscribe(POWER_MANAGEMENT_EVENT_MASK_BUTTON, on_button, &ui, 10, &subscription_id);
+ * 
+ * @param subscription_id the id to unsubscribe, may be NULL
+ */
+esp_err_t power_management_subscribe(
+                                power_management_event_mask_t events, 
+                                power_management_event_cb_t cb, 
+                                void * ctx, 
+                                uint8_t priority, 
+                                int * subscription_id
+                            );
+
+/**
+ * @brief Cancels the subscription made by power_management_subscribe()
+ */
+esp_err_t power_management_unsubscribe(int subscription_id);
+
 /**
  * @brief Initiates the power management daemon.
  * 
@@ -147,42 +260,60 @@ esp_err_t power_management_deregister_event_handler(
  * 
  * - off_charger_loop_cb
  * 
- * - button_cb
- * 
- * - charger_connected_cb
- * 
- * - device_woken_up_cb
+ * - button_cb, charger_connected_cb and device_woken_up_cb, or inputs_cb instead of them
  * 
  * - loop_cb
  */
 void power_management_init();
 
 
+/**
+ * The requests to the power management daemon.
+ * 
+ * All of them are asynchronous: the request is handled by the daemon on its next iteration.
+ * Sleep, reboot, shutdown and power-on requests go through the separate urgent queue and are handled first.
+ * Idle timer reset, idle timeout and idle action requests are coalesced: only the latest value is applied.
+ * 
+ * Every request returns:
+ * 
+ * - ESP_OK if the request is accepted
+ * 
+ * - ESP_ERR_INVALID_STATE if the power management daemon is not initiated yet
+ * 
+ * - ESP_ERR_TIMEOUT if the requests queue is full and the request is dropped
+ * 
+ * The *_from_isr() variants may be called from the interrupt handler.
+ * The task_unblocked is set to pdTRUE if the context switch should be requested at the end of ISR, may be NULL.
+ */
+
 /**
  * @brief Reset the inactivity timer
  * 
  * When activity in idle state is performed (for example, any button pressed, touch is touched),
  * this function should be called to reset the inactivity timer.
  */
-void power_management_idle_reset_timer();
+esp_err_t power_management_idle_reset_timer();
+esp_err_t power_management_idle_reset_timer_from_isr(BaseType_t * task_unblocked);
 
 /**
  * @brief Set the idle timeout in milliseconds.
  * 
  * The timeout is used only in IDLE state.
  * Cannot be less than time set in POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS.
+ * 
+ * @return ESP_ERR_INVALID_STATE while the active UPS profile has its own idle timeout
  */
-void power_management_idle_set_timeout(uint64_t timeout_ms);
+esp_err_t power_management_idle_set_timeout(uint64_t timeout_ms);
 
 /**
  * @brief Get the idle timeout in milliseconds.
  */
-uint32_t power_management_idle_get_timeout();
+uint64_t power_management_idle_get_timeout();
 
 /**
  * @brief Set the action for IDLE when timeout expired
  * 
- * There are 3 actions:
+ * There are 4 actions:
  * 
  * - no action
  * 
@@ -190,11 +321,41 @@ uint32_t power_management_idle_get_timeout();
  * 
  * - sleep
  * 
+ * - light sleep, the device resumes to IDLE or ACTIVE after the wake-up
+ * 
  * Whatever the action set, the IDLE_TIMEOUT_EXPIRED event is emitted when IDLE timeout expired.
  * 
  * If the device is intended to use uninterruptably, use the action [no_action].
+ * 
+ * @return ESP_ERR_INVALID_STATE while the active UPS profile has its own idle timeout
  */
-void power_management_idle_timer_expired_action_set(power_management_idle_timer_expired_action_t action);
+esp_err_t power_management_idle_timer_expired_action_set(power_management_idle_timer_expired_action_t action);
+
+/**
+ * @brief Set the runtime settings
+ * 
+ * The settings are applied by power management daemon on its next iteration.
+ * If NVS is enabled in menuconfig, the changed settings are written to NVS when the device goes to sleep/shutdown/reboot
+ * or when the settings are not changed for POWER_MANAGEMENT_SETTINGS_FLUSH_QUIET_MS, and restored at the next start.
+ * The failed write is retried after the same quiet period.
+ * The idle timeout and idle action set by their own requests are kept the same way.
+ * While the active UPS profile has its own idle timeout, the idle timeout and action set here
+ * are kept, but take effect only on the profile without the idle timeout.
+ * 
+ * @return ESP_ERR_INVALID_ARG if the idle timeout is less than POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS 
+ * or the button thresholds are not ordered as debounce < long-press < very-long-press
+ */
+esp_err_t power_management_settings_set(const power_management_settings_t * settings);
+
+/**
+ * @brief Get the runtime settings
+ */
+void power_management_settings_get(power_management_settings_t * settings);
+
+/**
+ * @brief Write the changed runtime settings to NVS immediately
+ */
+esp_err_t power_management_settings_flush();
 
 /**
  * @brief Locking the power manager in active state using these mutex functions
@@ -205,8 +366,8 @@ void power_management_idle_timer_expired_action_set(power_management_idle_timer_
  * 
  * Please note that this lock is recursive, and the program must equal the lock_acquires and lock releases.
  */
-void power_management_active_lock_acquire();
-void power_management_active_lock_release();
+esp_err_t power_management_active_lock_acquire();
+esp_err_t power_management_active_lock_release();
 
 /**
  * @brief Triggers device to sleep
@@ -214,7 +375,18 @@ void power_management_active_lock_release();
  * It sets power management daemon to SLEEP_PREPARE state,
  * send the SLEEP event, awaits for gap time and call the sleep_cb.
  */
-void power_management_trigger_sleep();
+esp_err_t power_management_trigger_sleep();
+esp_err_t power_management_trigger_sleep_from_isr(BaseType_t * task_unblocked);
+
+/**
+ * @brief Triggers device to light sleep
+ * 
+ * It sets power management daemon to LIGHT_SLEEP state from IDLE or ACTIVE state,
+ * calls the light_sleep_cb and puts the device to light sleep.
+ * After the wake-up, the device resumes to IDLE or ACTIVE state.
+ */
+esp_err_t power_management_trigger_light_sleep();
+esp_err_t power_management_trigger_light_sleep_from_isr(BaseType_t * task_unblocked);
 
 /**
  * @brief Triggers device to shutdown
@@ -222,7 +394,8 @@ void power_management_trigger_sleep();
  * It sets power management daemon to SHUTDOWN_PREPARE state,
  * send the SHUTDOWN event, awaits for gap time and call the shutdown_cb.
  */
-void power_management_trigger_shutdown();
+esp_err_t power_management_trigger_shutdown();
+esp_err_t power_management_trigger_shutdown_from_isr(BaseType_t * task_unblocked);
 
 /**
  * @brief Triggers device to reboot
@@ -230,14 +403,76 @@ void power_management_trigger_shutdown();
  * It sets power management daemon to REBOOT_PREPARE state,
  * send the REBOOT event, awaits for gap time and call the reboot_cb.
  */
-void power_management_trigger_reboot();
+esp_err_t power_management_trigger_reboot();
+esp_err_t power_management_trigger_reboot_from_isr(BaseType_t * task_unblocked);
 
 /**
  * @brief Powers on device
  * Please note that this call will work only from OFF_CHARGE state.
  * Useful for devices that powered from mains but battery is used as a backup power source.
  */
-void power_management_trigger_power_on();
+esp_err_t power_management_trigger_power_on();
+esp_err_t power_management_trigger_power_on_from_isr(BaseType_t * task_unblocked);
+
+/**
+ * @brief Set the time budget and the execution policy of the application callback
+ * 
+ * The setup, PMIC loop, off-charger setup and off-charger loop callbacks are timed with esp_timer.
+ * The call longer than budget_ms (0 - no budget) is counted in the statistics,
+ * and the CALLBACK_OVERRUN event is emitted with power_management_callback_overrun_t
+ * at the first overrun after the call within the budget.
+ * By default the loop callbacks have POWER_MANAGEMENT_CALLBACK_BUDGET_MS budget and the setup callbacks have none.
+ * 
+ * With POWER_MANAGEMENT_CALLBACK_POLICY_WORKER the loop callbacks are called by the lower-priority worker task
+ * (enabled in menuconfig), so a slow callback does not stall the requests, the idle timer and the button handling.
+ * The call is skipped while the previous one is not finished. 
+ * 
+ * @return ESP_ERR_NOT_SUPPORTED for the worker policy of the setup callbacks or if the worker is disabled
+ */
+esp_err_t power_management_callback_budget_set(
+                                            power_management_callback_t callback, 
+                                            uint32_t budget_ms, 
+                                            power_management_callback_policy_t policy
+                                        );
+
+/**
+ * @brief Get the current state of the power management daemon
+ */
+power_management_state_t power_management_get_state();
+
+/**
+ * @brief Get the time left until the idle timer expires, 0 if it is already expired
+ */
+uint64_t power_management_idle_time_left_ms();
+
+/**
+ * @brief Get the statistics of the power management daemon since the start
+ *
+ * The residency of the current state includes the time spent in it so far.
+ * Only the callbacks timings are filled if CONFIG_POWER_MANAGEMENT_DIAGNOSTICS is disabled.
+ */
+void power_management_stats_get(power_management_stats_t * stats);
+
+/**
+ * @brief Get the number of the active locks held
+ */
+int power_management_active_lock_count();
+
+/**
+ * @brief Get the tasks holding the active lock
+ *
+ * Only the first POWER_MANAGEMENT_LOCK_HOLDERS_MAX tasks are tracked, none if CONFIG_POWER_MANAGEMENT_DIAGNOSTICS is disabled.
+ *
+ * @return the number of holders copied
+ */
+size_t power_management_active_lock_holders_get(power_management_lock_holder_t * holders, size_t max_holders);
+
+/**
+ * @brief Get the last POWER_MANAGEMENT_EVENT_HISTORY_SIZE events emitted, the oldest first
+ *
+ * @return the number of records copied
+ */
+size_t power_management_event_history_get(power_management_event_record_t * records, size_t max_records);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,240 @@
+#ifndef POWER_MANAGEMENT_HPP
+#define POWER_MANAGEMENT_HPP
+
+#include "power_management.h"
+#include "esp_log.h"
+#include <type_traits>
+
+/**
+ * The header-only C++ layer over the power management C API.
+ *
+ * - ActiveLock - RAII guard of the active lock
+ *
+ * - Subscription - RAII event handler registration, the event and the handler are bound at compile time
+ *
+ * - init<Policy>() - binds the callbacks defined in the policy struct at compile time and starts the daemon.
+ * The missing mandatory callback is the build error instead of the assert at power_management_init().
+ *
+ * The C core behaviour is not changed.
+ */
+namespace power_management {
+
+/**
+ * @brief Keeps the power management daemon in ACTIVE state while the guard is alive
+ */
+class ActiveLock {
+public:
+    ActiveLock() : acquired_(power_management_active_lock_acquire() == ESP_OK) {}
+
+    ~ActiveLock() {
+        if (acquired_) power_management_active_lock_release();
+    }
+
+    ActiveLock(const ActiveLock &) = delete;
+    ActiveLock & operator=(const ActiveLock &) = delete;
+
+    /**
+     * @brief False if the lock request was not accepted (e.g. the daemon is not initiated yet)
+     */
+    bool acquired() const { return acquired_; }
+
+private:
+    bool acquired_;
+};
+
+/**
+ * @brief The type of the event data, void for the events without data
+ */
+template <power_management_event_t Event>
+struct EventData {
+    using type = void;
+};
+
+template <>
+struct EventData<POWER_MANAGEMENT_EVENT_DEVICE_LIGHT_SLEEP_WAKEUP> {
+    using type = power_management_light_sleep_wakeup_t;
+};
+
+template <>
+struct EventData<POWER_MANAGEMENT_EVENT_STATE_CHANGED> {
+    using type = power_management_state_change_t;
+};
+
+template <>
+struct EventData<POWER_MANAGEMENT_EVENT_CALLBACK_OVERRUN> {
+    using type = power_management_callback_overrun_t;
+};
+
+template <>
+struct EventData<POWER_MANAGEMENT_EVENT_UPS_PROFILE_CHANGED> {
+    using type = power_management_ups_profile_change_t;
+};
+
+/**
+ * @brief Registers the handler for the event while the subscription is alive
+ *
+ * The handler is called as Handler(const EventData<Event>::type * data),
+ * or Handler(power_management_event_t event, const void * data) for POWER_MANAGEMENT_EVENT_ANY.
+ *
+ * The default event loop must be created before the subscription, so it must not be a namespace-scope object
+ * constructed before app_main(). The failed registration is logged and returned by error().
+ *
+ * Usage:
+ *
+ *  void on_wakeup(const power_management_light_sleep_wakeup_t * wakeup);
+ *
+ *  esp_event_loop_create_default();
+ *  static power_management::Subscription<POWER_MANAGEMENT_EVENT_DEVICE_LIGHT_SLEEP_WAKEUP, on_wakeup> wakeup_subscription;
+ */
+template <power_management_event_t Event, auto Handler>
+class Subscription {
+    static_assert(
+                Event == POWER_MANAGEMENT_EVENT_ANY || (Event >= 0 && Event < POWER_MANAGEMENT_EVENT_MAX),
+                "Unknown power management event"
+            );
+
+public:
+    Subscription() : err_(power_management_register_event_handler(Event, &Subscription::dispatch)) {
+        if (err_ != ESP_OK) {
+            ESP_LOGE(
+                    "PowerManagement",
+                    "Cannot register the handler of %s event: %s",
+                    power_management_event_to_str(Event),
+                    esp_err_to_name(err_)
+                );
+        }
+    }
+
+    ~Subscription() {
+        if (err_ == ESP_OK) power_management_deregister_event_handler(Event, &Subscription::dispatch);
+    }
+
+    Subscription(const Subscription &) = delete;
+    Subscription & operator=(const Subscription &) = delete;
+
+    esp_err_t error() const { return err_; }
+
+private:
+    static void dispatch(void * handler_arg, esp_event_base_t base, int32_t id, void * event_data) {
+        if constexpr (Event == POWER_MANAGEMENT_EVENT_ANY) {
+            static_assert(
+                        std::is_invocable_v<decltype(Handler), power_management_event_t, const void *>,
+                        "The handler of any event must be callable as handler(power_management_event_t, const void *)"
+                    );
+            Handler(static_cast<power_management_event_t>(id), event_data);
+        }
+        else {
+            using data_t = typename EventData<Event>::type;
+            static_assert(
+                        std::is_invocable_v<decltype(Handler), const data_t *>,
+                        "The event handler must be callable as handler(const EventData<Event>::type *)"
+                    );
+            Handler(static_cast<const data_t *>(event_data));
+        }
+    }
+
+    esp_err_t err_;
+};
+
+namespace detail {
+
+#define POWER_MANAGEMENT_HPP_DETECT(name, ...)                                                          \
+    template <typename P, typename = void>                                                              \
+    struct has_##name : std::false_type {};                                                             \
+    template <typename P>                                                                               \
+    struct has_##name<P, std::void_t<decltype(P::name(__VA_ARGS__))>> : std::true_type {};
+
+POWER_MANAGEMENT_HPP_DETECT(setup)
+POWER_MANAGEMENT_HPP_DETECT(sleep)
+POWER_MANAGEMENT_HPP_DETECT(reboot)
+POWER_MANAGEMENT_HPP_DETECT(shutdown)
+POWER_MANAGEMENT_HPP_DETECT(off_charger_setup)
+POWER_MANAGEMENT_HPP_DETECT(off_charger_loop)
+POWER_MANAGEMENT_HPP_DETECT(loop)
+POWER_MANAGEMENT_HPP_DETECT(button)
+POWER_MANAGEMENT_HPP_DETECT(charger_connected)
+POWER_MANAGEMENT_HPP_DETECT(woken_up)
+POWER_MANAGEMENT_HPP_DETECT(inputs, static_cast<power_management_inputs_t *>(nullptr))
+POWER_MANAGEMENT_HPP_DETECT(light_sleep)
+
+#undef POWER_MANAGEMENT_HPP_DETECT
+
+// The policy functions are called directly from these trampolines, so the compiler can inline them here
+template <typename Policy>
+struct Bind {
+    static void setup() { Policy::setup(); }
+    static void sleep() { Policy::sleep(); }
+    static void reboot() { Policy::reboot(); }
+    static void shutdown() { Policy::shutdown(); }
+    static void off_charger_setup() { Policy::off_charger_setup(); }
+    static void off_charger_loop() { Policy::off_charger_loop(); }
+    static void loop() { Policy::loop(); }
+    static bool button() { return Policy::button(); }
+    static bool charger_connected() { return Policy::charger_connected(); }
+    static bool woken_up() { return Policy::woken_up(); }
+    static void inputs(power_management_inputs_t * inputs) { Policy::inputs(inputs); }
+    static void light_sleep() { Policy::light_sleep(); }
+};
+
+} // namespace detail
+
+/**
+ * @brief Binds the policy callbacks and initiates the power management daemon
+ *
+ * The policy is the struct with the static functions:
+ *
+ * - setup(), sleep(), reboot(), shutdown(), off_charger_setup(), off_charger_loop(), loop() - mandatory
+ *
+ * - button(), charger_connected(), woken_up() returning bool, or inputs(power_management_inputs_t *) instead of them
+ *
+ * - light_sleep() - optional
+ */
+template <typename Policy>
+void init() {
+    static_assert(detail::has_setup<Policy>::value, "The policy must define static void setup()");
+    static_assert(detail::has_sleep<Policy>::value, "The policy must define static void sleep()");
+    static_assert(detail::has_reboot<Policy>::value, "The policy must define static void reboot()");
+    static_assert(detail::has_shutdown<Policy>::value, "The policy must define static void shutdown()");
+    static_assert(detail::has_off_charger_setup<Policy>::value, "The policy must define static void off_charger_setup()");
+    static_assert(detail::has_off_charger_loop<Policy>::value, "The policy must define static void off_charger_loop()");
+    static_assert(detail::has_loop<Policy>::value, "The policy must define static void loop()");
+
+    constexpr bool has_inputs = detail::has_inputs<Policy>::value;
+    constexpr bool has_separate_inputs = detail::has_button<Policy>::value &&
+                                        detail::has_charger_connected<Policy>::value &&
+                                        detail::has_woken_up<Policy>::value;
+    static_assert(
+                has_inputs || has_separate_inputs,
+                "The policy must define static void inputs(power_management_inputs_t *) "
+                "or static bool button(), charger_connected() and woken_up()"
+            );
+
+    using bind_t = detail::Bind<Policy>;
+
+    power_management_set_setup_cb(&bind_t::setup);
+    power_management_set_sleep_cb(&bind_t::sleep);
+    power_management_set_reboot_cb(&bind_t::reboot);
+    power_management_set_shutdown_cb(&bind_t::shutdown);
+    power_management_set_off_charger_setup_cb(&bind_t::off_charger_setup);
+    power_management_set_off_charger_loop_cb(&bind_t::off_charger_loop);
+    power_management_set_loop_cb(&bind_t::loop);
+
+    if constexpr (has_inputs) {
+        power_management_set_inputs_cb(&bind_t::inputs);
+    }
+    else {
+        power_management_set_button_cb(&bind_t::button);
+        power_management_set_charger_connected_cb(&bind_t::charger_connected);
+        power_management_set_device_woken_up_cb(&bind_t::woken_up);
+    }
+
+    if constexpr (detail::has_light_sleep<Policy>::value) {
+        power_management_set_light_sleep_cb(&bind_t::light_sleep);
+    }
+
+    power_management_init();
+}
+
+} // namespace power_management
+
+#endif // POWER_MANAGEMENT_HPP
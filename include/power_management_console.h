@@ -0,0 +1,43 @@
+#ifndef POWER_MANAGEMENT_CONSOLE_H
+#define POWER_MANAGEMENT_CONSOLE_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The diagnostics console command, enabled by CONFIG_POWER_MANAGEMENT_CONSOLE.
+ *
+ * pm status                - the current state, idle time left, active locks and inputs
+ *
+ * pm stats                 - the loops, requests and state residency counters
+ *
+ * pm locks                 - the tasks holding the active lock
+ *
+ * pm trace                 - the last emitted events
+ *
+ * pm settings              - the runtime settings
+ *
+ * pm set-timeout <ms>      - set the idle timeout
+ *
+ * pm trigger <sleep|light-sleep|shutdown|reboot> - request the state change
+ *
+ * pm bench [s]             - measure the loops and inputs sample rates for the given seconds (1 by default)
+ */
+
+/**
+ * @brief Registers the "pm" command in esp_console
+ *
+ * The console must be initiated by the application (e.g. esp_console_new_repl_uart()) before this call.
+ *
+ * @return ESP_ERR_NOT_SUPPORTED if CONFIG_POWER_MANAGEMENT_CONSOLE is disabled
+ */
+esp_err_t power_management_console_register();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // POWER_MANAGEMENT_CONSOLE_H
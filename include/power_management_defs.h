@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include "esp_event.h"
 #include "sdkconfig.h"
 
@@ -38,6 +39,9 @@
  * and then calling the sleep call.
  * 
  * - SLEEP - device is sleeping 
+ * 
+ * - LIGHT_SLEEP - device is in light sleep. SRAM is preserved, 
+ * so after the wake-up the device resumes directly to IDLE or ACTIVE without going through INIT and SETUP.
  */
 typedef enum : uint8_t {
     POWER_MANAGEMENT_STATE_INIT = 0,
@@ -50,6 +54,7 @@ typedef enum : uint8_t {
     POWER_MANAGEMENT_STATE_REBOOT_PREPARE,
     POWER_MANAGEMENT_STATE_SLEEP_PREPARE,
     POWER_MANAGEMENT_STATE_SLEEP,
+    POWER_MANAGEMENT_STATE_LIGHT_SLEEP,
     POWER_MANAGEMENT_STATE_MAX
 } power_management_state_t;
 
@@ -89,6 +94,11 @@ typedef enum {
     POWER_MANAGEMENT_EVENT_BATTERY_LEVEL_UPDATED,
     POWER_MANAGEMENT_EVENT_PORT_CURRENT_UPDATED,
     POWER_MANAGEMENT_EVENT_USER,
+    // Added after USER, so the ids of the events above keep their values
+    POWER_MANAGEMENT_EVENT_DEVICE_LIGHT_SLEEP_WAKEUP,
+    POWER_MANAGEMENT_EVENT_STATE_CHANGED,
+    POWER_MANAGEMENT_EVENT_CALLBACK_OVERRUN,
+    POWER_MANAGEMENT_EVENT_UPS_PROFILE_CHANGED,
     POWER_MANAGEMENT_EVENT_MAX
 } power_management_event_t;
 
@@ -109,15 +119,32 @@ typedef enum {
     POWER_MANAGEMENT_REQUEST_TYPE_REBOOT,
     POWER_MANAGEMENT_REQUEST_TYPE_SHUTDOWN,
     POWER_MANAGEMENT_REQUEST_TYPE_POWER_ON,
+    POWER_MANAGEMENT_REQUEST_TYPE_LIGHT_SLEEP,
+    POWER_MANAGEMENT_REQUEST_TYPE_SETTINGS_SET,
     POWER_MANAGEMENT_REQUEST_TYPE_MAX
 } power_management_request_type_t;
 
 typedef enum {
     POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT = 0,
     POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_SLEEP,
-    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_SHUTDOWN
+    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_SHUTDOWN,
+    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_LIGHT_SLEEP
 } power_management_idle_timer_expired_action_t;
 
+// The application callbacks returning to the state machine, so their time can be budgeted
+typedef enum {
+    POWER_MANAGEMENT_CALLBACK_SETUP = 0,
+    POWER_MANAGEMENT_CALLBACK_PMIC_LOOP,
+    POWER_MANAGEMENT_CALLBACK_OFF_CHARGER_SETUP,
+    POWER_MANAGEMENT_CALLBACK_OFF_CHARGER_LOOP,
+    POWER_MANAGEMENT_CALLBACK_MAX
+} power_management_callback_t;
+
+typedef enum {
+    POWER_MANAGEMENT_CALLBACK_POLICY_INLINE = 0,    // Called by the power management task
+    POWER_MANAGEMENT_CALLBACK_POLICY_WORKER         // Called by the lower-priority worker task, the loop callbacks only
+} power_management_callback_policy_t;
+
 inline const char * power_management_state_to_str(power_management_state_t state) {
     switch (state) {
         case POWER_MANAGEMENT_STATE_INIT: return "INIT";
@@ -130,6 +157,7 @@ inline const char * power_management_state_to_str(power_management_state_t state
         case POWER_MANAGEMENT_STATE_REBOOT_PREPARE: return "REBOOT_PREPARE";
         case POWER_MANAGEMENT_STATE_SLEEP_PREPARE: return "SLEEP_PREPARE";
         case POWER_MANAGEMENT_STATE_SLEEP: return "SLEEP";
+        case POWER_MANAGEMENT_STATE_LIGHT_SLEEP: return "LIGHT_SLEEP";
         default: return "UNKNOWN";
     }
 }
@@ -139,6 +167,17 @@ inline const char * power_management_idle_timer_expired_action_to_str(power_mana
         case POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT: return "NoAction";
         case POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_SLEEP: return "ActionSLEEP";
         case POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_SHUTDOWN: return "ActionSHUTDOWN";
+        case POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_LIGHT_SLEEP: return "ActionLIGHT_SLEEP";
+        default: return "UNKNOWN";
+    }
+}
+
+inline const char * power_management_callback_to_str(power_management_callback_t callback) {
+    switch (callback) {
+        case POWER_MANAGEMENT_CALLBACK_SETUP: return "SETUP";
+        case POWER_MANAGEMENT_CALLBACK_PMIC_LOOP: return "PMIC_LOOP";
+        case POWER_MANAGEMENT_CALLBACK_OFF_CHARGER_SETUP: return "OFF_CHARGER_SETUP";
+        case POWER_MANAGEMENT_CALLBACK_OFF_CHARGER_LOOP: return "OFF_CHARGER_LOOP";
         default: return "UNKNOWN";
     }
 }
@@ -178,6 +217,10 @@ inline const char * power_management_event_to_str(power_management_event_t event
         case POWER_MANAGEMENT_EVENT_BATTERY_LEVEL_UPDATED: return "BATTERY_LEVEL_UPDATED";
         case POWER_MANAGEMENT_EVENT_PORT_CURRENT_UPDATED: return "PORT_CURRENT_UPDATED";
         case POWER_MANAGEMENT_EVENT_USER: return "USER_EVENT";
+        case POWER_MANAGEMENT_EVENT_DEVICE_LIGHT_SLEEP_WAKEUP: return "DEVICE_LIGHT_SLEEP_WAKEUP";
+        case POWER_MANAGEMENT_EVENT_STATE_CHANGED: return "STATE_CHANGED";
+        case POWER_MANAGEMENT_EVENT_CALLBACK_OVERRUN: return "CALLBACK_OVERRUN";
+        case POWER_MANAGEMENT_EVENT_UPS_PROFILE_CHANGED: return "UPS_PROFILE_CHANGED";
         default: return "UNKNOWN";
     }
 }
@@ -188,13 +231,209 @@ typedef struct {
     uint64_t inactivity_time_ms;
 } power_management_request_t;
 
+/**
+ * @brief The set of events for the mask subscriptions, one bit per power_management_event_t
+ */
+typedef uint64_t power_management_event_mask_t;
+
+#define POWER_MANAGEMENT_EVENT_BIT(event)                           ((power_management_event_mask_t)1 << (event))
+#define POWER_MANAGEMENT_EVENT_MASK_ALL                             (POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_MAX) - 1)
+#define POWER_MANAGEMENT_EVENT_MASK_BUTTON                          (POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_BUTTON_RELEASED) | \
+                                                                    POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_BUTTON_PRESSED) | \
+                                                                    POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_BUTTON_CLICKED) | \
+                                                                    POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_BUTTON_LONG_PRESSED) | \
+                                                                    POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_BUTTON_VERY_LONG_PRESSED))
+#define POWER_MANAGEMENT_EVENT_MASK_DEVICE                          (POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_DEVICE_SHUTDOWN) | \
+                                                                    POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_DEVICE_SLEEP) | \
+                                                                    POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_DEVICE_REBOOT) | \
+                                                                    POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_DEVICE_SETUP_FINISHED) | \
+                                                                    POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_DEVICE_LIGHT_SLEEP_WAKEUP))
+
+/**
+ * @brief The handler of the mask subscription
+ * 
+ * - event - the event emitted
+ * 
+ * - event_data - the data passed to power_management_emit_event(), may be NULL
+ * 
+ * - ctx - the context pointer given at the subscription
+ */
+typedef void (*power_management_event_cb_t)(power_management_event_t event, void * event_data, void * ctx);
+
+/**
+ * @brief The data of STATE_CHANGED event
+ */
+typedef struct {
+    power_management_state_t from;
+    power_management_state_t to;
+} power_management_state_change_t;
+
+/**
+ * @brief Power management daemon statistics since power_management_init()
+ * 
+ * - loops - power management task iterations
+ * 
+ * - button_loops - button task iterations
+ * 
+ * - requests_processed - the requests handled, including the coalesced ones
+ * 
+ * - requests_coalesced - the requests overwritten by the later request of the same type before being handled
+ * 
+ * - requests_dropped - the requests rejected as the queue was full
+ * 
+ * - state_transitions - the number of state changes
+ * 
+ * - state_residency_ms - the time spent in every state
+ * 
+ * - callback_overruns - the number of calls exceeded the callback budget
+ * 
+ * - callback_max_duration_us - the longest call of every callback
+ */
+typedef struct {
+    uint32_t loops;
+    uint32_t button_loops;
+    uint32_t requests_processed;
+    uint32_t requests_coalesced;
+    uint32_t requests_dropped;
+    uint32_t state_transitions;
+    uint64_t state_residency_ms[POWER_MANAGEMENT_STATE_MAX];
+    uint32_t callback_overruns[POWER_MANAGEMENT_CALLBACK_MAX];
+    uint32_t callback_max_duration_us[POWER_MANAGEMENT_CALLBACK_MAX];
+} power_management_stats_t;
+
+/**
+ * @brief The data of CALLBACK_OVERRUN event
+ */
+typedef struct {
+    power_management_callback_t callback;
+    uint32_t budget_ms;
+    uint64_t duration_us;
+} power_management_callback_overrun_t;
+
+typedef enum {
+    POWER_MANAGEMENT_UPS_PROFILE_MAINS = 0,
+    POWER_MANAGEMENT_UPS_PROFILE_BATTERY,
+    POWER_MANAGEMENT_UPS_PROFILE_MAX
+} power_management_ups_profile_id_t;
+
+/**
+ * @brief The data of UPS_PROFILE_CHANGED event
+ * 
+ * - profile - the profile switched to
+ * 
+ * - hold_up_time_s - the battery energy / the average power of the BATTERY profile, 0 if unknown
+ */
+typedef struct {
+    power_management_ups_profile_id_t profile;
+    uint32_t hold_up_time_s;
+} power_management_ups_profile_change_t;
+
+inline const char * power_management_ups_profile_to_str(power_management_ups_profile_id_t profile) {
+    switch (profile) {
+        case POWER_MANAGEMENT_UPS_PROFILE_MAINS: return "MAINS";
+        case POWER_MANAGEMENT_UPS_PROFILE_BATTERY: return "BATTERY";
+        default: return "UNKNOWN";
+    }
+}
+
+/**
+ * @brief The emitted event record kept in the event history
+ */
+typedef struct {
+    uint64_t timestamp_ms;
+    power_management_event_t event;
+} power_management_event_record_t;
+
+#define POWER_MANAGEMENT_LOCK_HOLDERS_MAX                           8
+#define POWER_MANAGEMENT_LOCK_HOLDER_NAME_LEN                       16
+
+/**
+ * @brief The task holding the active lock
+ */
+typedef struct {
+    char task_name[POWER_MANAGEMENT_LOCK_HOLDER_NAME_LEN];
+    uint32_t count;
+} power_management_lock_holder_t;
+
+/**
+ * @brief The snapshot of the inputs shared by the button and power management tasks
+ * 
+ * - button_pressed - the raw button state
+ * 
+ * - charger_connected - the charger connection state
+ * 
+ * - woken_up - the device waking up flag
+ * 
+ * - timestamp_ms - the time of sampling, see power_management_millis()
+ * 
+ * - sequence - the number of the sample, incremented every time the inputs are read
+ */
+typedef struct {
+    bool button_pressed;
+    bool charger_connected;
+    bool woken_up;
+    uint64_t timestamp_ms;
+    uint32_t sequence;
+} power_management_inputs_t;
+
+/**
+ * @brief The runtime settings of power management daemon
+ * 
+ * The defaults are set in menuconfig. 
+ * The settings changed at runtime are kept in NVS (if enabled in menuconfig) and restored at the next start.
+ */
+typedef struct {
+    uint64_t idle_timeout_ms;
+    power_management_idle_timer_expired_action_t idle_timer_expired_action;
+    uint32_t button_debounce_time_ms;
+    uint32_t button_long_press_time_ms;
+    uint32_t button_very_long_press_time_ms;
+    uint32_t event_and_action_gap_ms;
+} power_management_settings_t;
+
+/**
+ * @brief The data of DEVICE_LIGHT_SLEEP_WAKEUP event
+ * 
+ * - wakeup_cause - the esp_sleep_wakeup_cause_t value
+ * 
+ * - slept_us - the time spent in light sleep
+ * 
+ * - resume_latency_us - the time since the return of esp_light_sleep_start() until the daemon has set the resumed state
+ */
+typedef struct {
+    uint32_t wakeup_cause;
+    uint64_t slept_us;
+    uint64_t resume_latency_us;
+} power_management_light_sleep_wakeup_t;
+
 #define POWER_MANAGEMENT_BUTTON_DEBOUNCE_TIME_MS                    CONFIG_POWER_MANAGEMENT_BUTTON_DEBOUNCE_TIME_MS
 #define POWER_MANAGEMENT_BUTTON_LONG_PRESS_TIME_MS                  CONFIG_POWER_MANAGEMENT_BUTTON_LONG_PRESS_TIME_MS
 #define POWER_MANAGEMENT_BUTTON_VERY_LONG_PRESS_TIME_MS             CONFIG_POWER_MANAGEMENT_BUTTON_VERY_LONG_PRESS_TIME_MS
 
-#define POWER_MANAGEMENT_IDLE_TIMEOUT_MS                            30000
-#define POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS                        30000
-#define POWER_MANAGEMENT_REQUESTS_QUEUE_SIZE                        10
-#define POWER_MANAGEMENT_EVENT_AND_ACTION_ON_SLEEP_SHUTDOWN_GAP_MS  3000
+#define POWER_MANAGEMENT_IDLE_TIMEOUT_MS                            CONFIG_POWER_MANAGEMENT_IDLE_TIMEOUT_MS
+#define POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS                        CONFIG_POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS
+#define POWER_MANAGEMENT_REQUESTS_QUEUE_SIZE                        CONFIG_POWER_MANAGEMENT_REQUESTS_QUEUE_SIZE
+#define POWER_MANAGEMENT_URGENT_REQUESTS_QUEUE_SIZE                 CONFIG_POWER_MANAGEMENT_URGENT_REQUESTS_QUEUE_SIZE
+#define POWER_MANAGEMENT_EVENT_AND_ACTION_ON_SLEEP_SHUTDOWN_GAP_MS  CONFIG_POWER_MANAGEMENT_EVENT_AND_ACTION_ON_SLEEP_SHUTDOWN_GAP_MS
+#define POWER_MANAGEMENT_INPUTS_SAMPLE_PERIOD_MS                    CONFIG_POWER_MANAGEMENT_INPUTS_SAMPLE_PERIOD_MS
+#define POWER_MANAGEMENT_UPS_MAINS_LOST_HOLD_MS                     CONFIG_POWER_MANAGEMENT_UPS_MAINS_LOST_HOLD_MS
+#if CONFIG_POWER_MANAGEMENT_DIAGNOSTICS
+#define POWER_MANAGEMENT_EVENT_HISTORY_SIZE                         CONFIG_POWER_MANAGEMENT_EVENT_HISTORY_SIZE
+#else
+#define POWER_MANAGEMENT_EVENT_HISTORY_SIZE                         0
+#endif
+#define POWER_MANAGEMENT_SUBSCRIBERS_MAX                            CONFIG_POWER_MANAGEMENT_SUBSCRIBERS_MAX
+#define POWER_MANAGEMENT_CALLBACK_BUDGET_MS                         CONFIG_POWER_MANAGEMENT_CALLBACK_BUDGET_MS
+#define POWER_MANAGEMENT_TRACE_RING_SIZE                            CONFIG_POWER_MANAGEMENT_TRACE_RING_SIZE
+#define POWER_MANAGEMENT_RADIO_OPS_MAX                              CONFIG_POWER_MANAGEMENT_RADIO_OPS_MAX
+#define POWER_MANAGEMENT_RADIO_DEFERRED_MAX                         CONFIG_POWER_MANAGEMENT_RADIO_DEFERRED_MAX
+#define POWER_MANAGEMENT_SETTINGS_FLUSH_QUIET_MS                    CONFIG_POWER_MANAGEMENT_SETTINGS_FLUSH_QUIET_MS
+
+#define POWER_MANAGEMENT_JOBS_MAX                                   CONFIG_POWER_MANAGEMENT_JOBS_MAX
+
+#define POWER_MANAGEMENT_EMERGENCY_HOOKS_MAX                        CONFIG_POWER_MANAGEMENT_EMERGENCY_HOOKS_MAX
+#define POWER_MANAGEMENT_EMERGENCY_BUDGET_MS                        CONFIG_POWER_MANAGEMENT_EMERGENCY_BUDGET_MS
+#define POWER_MANAGEMENT_EMERGENCY_STOP_TIMEOUT_MS                  CONFIG_POWER_MANAGEMENT_EMERGENCY_STOP_TIMEOUT_MS
+#define POWER_MANAGEMENT_EMERGENCY_TASK_STACK_SIZE                  CONFIG_POWER_MANAGEMENT_EMERGENCY_TASK_STACK_SIZE
 
 #endif
\ No newline at end of file
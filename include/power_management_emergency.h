@@ -0,0 +1,111 @@
+#ifndef POWER_MANAGEMENT_EMERGENCY_H
+#define POWER_MANAGEMENT_EMERGENCY_H
+
+#include "power_management_defs.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The emergency shutdown.
+ *
+ * When the battery collapses (critically low battery, brown-out warning from PMIC),
+ * there is no time for SHUTDOWN_PREPARE with its gap, and the shutdown request may wait behind the other requests.
+ * The emergency shutdown bypasses the requests queues and preempts the power management daemon:
+ * the highest-priority task stops the power management tasks, runs the registered must-flush hooks
+ * within the total time budget and calls the shutdown_cb.
+ *
+ * The power management tasks stop themselves at the points holding no lock within POWER_MANAGEMENT_EMERGENCY_STOP_TIMEOUT_MS.
+ * If a task is not stopped in time (e.g. a slow PMIC loop callback), it keeps running and TASKS_STOP_TIMEOUT step is recorded,
+ * then the hooks must not wait for the resources the application callbacks hold (e.g. the PMIC I2C bus)
+ * longer than their budget, and must not post the events with the blocking wait.
+ *
+ * Every step is timestamped and kept in RTC memory, so the trace can be read after the restart.
+ */
+
+typedef enum {
+    POWER_MANAGEMENT_EMERGENCY_STEP_TRIGGERED = 0,
+    POWER_MANAGEMENT_EMERGENCY_STEP_STARTED,
+    POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_STARTED,
+    POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_FINISHED,
+    POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_OVERRUN,
+    POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_SKIPPED,
+    POWER_MANAGEMENT_EMERGENCY_STEP_SHUTDOWN,
+    POWER_MANAGEMENT_EMERGENCY_STEP_TASKS_STOPPED,
+    POWER_MANAGEMENT_EMERGENCY_STEP_TASKS_STOP_TIMEOUT,
+    POWER_MANAGEMENT_EMERGENCY_STEP_NO_SHUTDOWN_CB,
+    POWER_MANAGEMENT_EMERGENCY_STEP_MAX
+} power_management_emergency_step_t;
+
+/**
+ * @brief The emergency shutdown trace record
+ *
+ * - step - power_management_emergency_step_t
+ *
+ * - hook - the hook index for HOOK_* steps
+ *
+ * - time_us - esp_timer time of the step
+ */
+typedef struct {
+    uint8_t step;
+    uint8_t hook;
+    int64_t time_us;
+} power_management_emergency_record_t;
+
+/**
+ * @brief Registers the must-flush hook
+ *
+ * The hooks are run in the order of registration.
+ * The hook must finish within its budget. If the rest of the total budget (POWER_MANAGEMENT_EMERGENCY_BUDGET_MS)
+ * is less than the hook budget, the hook is skipped.
+ */
+esp_err_t power_management_emergency_hook_register(const char * name, void (*hook)(void * arg), void * arg, uint32_t budget_ms);
+
+/**
+ * @brief Triggers the emergency shutdown
+ *
+ * Can be called before power_management_init() as well, then the hooks and shutdown_cb are called in the caller context.
+ * If the shutdown_cb is not set yet, NO_SHUTDOWN_CB step is recorded and the function returns.
+ */
+esp_err_t power_management_emergency_shutdown();
+
+/**
+ * @brief Triggers the emergency shutdown from the interrupt handler, e.g. PMIC or brown-out interrupt
+ *
+ * The task_unblocked is set to pdTRUE if the context switch should be requested at the end of ISR, may be NULL.
+ */
+esp_err_t power_management_emergency_shutdown_from_isr(BaseType_t * task_unblocked);
+
+/**
+ * @brief Get the trace of the last emergency shutdown
+ *
+ * The trace survives the restart, but not the power loss.
+ *
+ * @return the number of records copied
+ */
+size_t power_management_emergency_get_trace(power_management_emergency_record_t * records, size_t max_records);
+
+inline const char * power_management_emergency_step_to_str(power_management_emergency_step_t step) {
+    switch (step) {
+        case POWER_MANAGEMENT_EMERGENCY_STEP_TRIGGERED: return "TRIGGERED";
+        case POWER_MANAGEMENT_EMERGENCY_STEP_STARTED: return "STARTED";
+        case POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_STARTED: return "HOOK_STARTED";
+        case POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_FINISHED: return "HOOK_FINISHED";
+        case POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_OVERRUN: return "HOOK_OVERRUN";
+        case POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_SKIPPED: return "HOOK_SKIPPED";
+        case POWER_MANAGEMENT_EMERGENCY_STEP_SHUTDOWN: return "SHUTDOWN";
+        case POWER_MANAGEMENT_EMERGENCY_STEP_TASKS_STOPPED: return "TASKS_STOPPED";
+        case POWER_MANAGEMENT_EMERGENCY_STEP_TASKS_STOP_TIMEOUT: return "TASKS_STOP_TIMEOUT";
+        case POWER_MANAGEMENT_EMERGENCY_STEP_NO_SHUTDOWN_CB: return "NO_SHUTDOWN_CB";
+        default: return "UNKNOWN";
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // POWER_MANAGEMENT_EMERGENCY_H
@@ -0,0 +1,85 @@
+#ifndef POWER_MANAGEMENT_JOBS_H
+#define POWER_MANAGEMENT_JOBS_H
+
+#include "power_management_defs.h"
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The periodic jobs registry.
+ *
+ * Every job has its period and the tolerance: how late the job may run to share the wake-up with the other jobs.
+ * Before the device goes to sleep, the power management daemon arms the timer wake-up
+ * at the latest time that still meets the deadlines of all the jobs,
+ * so the jobs whose time came by then are run in one batch after the wake-up.
+ *
+ * After the wake-up by this timer with nobody using the device, the daemon goes back to sleep right after the jobs.
+ *
+ * The schedule is in power management time (see power_management_millis()), so it follows the time source and time-warp.
+ * It's kept in RTC memory along with the RTC time of the sleep, so it survives the deep sleep.
+ * The jobs must be registered in the same order at every start, before power_management_init() is called.
+ */
+
+typedef struct {
+    const char * name;
+    uint32_t period_ms;
+    uint32_t tolerance_ms;
+    void (*cb)(void * arg);
+    void * arg;
+} power_management_job_config_t;
+
+typedef struct {
+    uint32_t wakes_uncoalesced;
+    uint32_t wakes_coalesced;
+    float wakes_per_day_uncoalesced;
+    float wakes_per_day_coalesced;
+} power_management_jobs_sim_result_t;
+
+/**
+ * @brief Registers the periodic job
+ *
+ * If the job in the same slot was scheduled before the sleep with the same period and tolerance,
+ * its schedule is restored, otherwise the job is first due in one period.
+ *
+ * @param job_id the job id, may be NULL
+ */
+esp_err_t power_management_job_register(const power_management_job_config_t * config, int * job_id);
+
+/**
+ * @brief Runs all the jobs whose time came
+ *
+ * Called by power management daemon after SETUP and in IDLE/ACTIVE states.
+ *
+ * @return the number of jobs run
+ */
+size_t power_management_jobs_run_due();
+
+/**
+ * @brief Get the delay before the next wake-up needed by the registered jobs
+ *
+ * @return ESP_ERR_NOT_FOUND if there are no jobs registered
+ */
+esp_err_t power_management_jobs_next_wakeup(uint64_t * delay_ms);
+
+/**
+ * @brief Simulates the jobs schedule without running the jobs
+ *
+ * Reports how many times the device wakes up during the duration
+ * if every job uses its own timer and if the wake-ups are coalesced.
+ * Does not touch the registry, so it can be called on Linux host as well.
+ */
+esp_err_t power_management_jobs_simulate(
+                                        const power_management_job_config_t * jobs,
+                                        size_t jobs_count,
+                                        uint64_t duration_ms,
+                                        power_management_jobs_sim_result_t * result
+                                    );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // POWER_MANAGEMENT_JOBS_H
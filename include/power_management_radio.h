@@ -0,0 +1,105 @@
+#ifndef POWER_MANAGEMENT_RADIO_H
+#define POWER_MANAGEMENT_RADIO_H
+
+#include "power_management_defs.h"
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The radio-aware idle coordination.
+ *
+ * - The network operations hold the active lock while they run, so the device does not sleep mid-transfer,
+ * and the lock is released automatically at the end of the operation or when its timeout expires.
+ *
+ * - The radio is switched to modem-sleep when the device goes to DEV_IDLE and back when it goes to DEV_ACTIVE.
+ *
+ * - The non-urgent sends are deferred to the next active window: DEV_ACTIVE state or the end of a network operation.
+ * The deferred sends are lost on deep sleep, shutdown and reboot.
+ *
+ * The radio is controlled by the backend: Wi-Fi (CONFIG_POWER_MANAGEMENT_RADIO_WIFI), the stub for the tests on Linux host,
+ * or the application one (e.g. BLE).
+ */
+
+/**
+ * @brief The radio backend
+ *
+ * - name - the backend name for the logs
+ *
+ * - set_modem_sleep - enables or disables the radio modem-sleep, called in the default event loop task
+ *
+ * - ctx - the backend context passed to its functions
+ */
+typedef struct {
+    const char * name;
+    esp_err_t (*set_modem_sleep)(bool enable, void * ctx);
+    void * ctx;
+} power_management_radio_backend_t;
+
+/**
+ * @brief The state of the stub backend
+ */
+typedef struct {
+    bool modem_sleep;
+    uint32_t switches;
+} power_management_radio_stub_t;
+
+/**
+ * @brief Get the stub backend keeping the modem-sleep state in the stub
+ */
+power_management_radio_backend_t power_management_radio_stub_backend(power_management_radio_stub_t * stub);
+
+/**
+ * @brief Get the Wi-Fi backend switching esp_wifi power save mode
+ *
+ * @return the backend without set_modem_sleep if CONFIG_POWER_MANAGEMENT_RADIO_WIFI is disabled
+ */
+power_management_radio_backend_t power_management_radio_wifi_backend();
+
+/**
+ * @brief Starts the radio coordination with the backend
+ *
+ * The default event loop must be created before.
+ */
+esp_err_t power_management_radio_init(const power_management_radio_backend_t * backend);
+
+/**
+ * @brief Begins the network operation, the active lock is held until power_management_radio_op_end()
+ *
+ * @param timeout_ms the lock is released if the operation is not ended by then, 0 - no timeout
+ * @param op_id the operation id for power_management_radio_op_end()
+ */
+esp_err_t power_management_radio_op_begin(const char * name, uint32_t timeout_ms, int * op_id);
+
+/**
+ * @brief Ends the network operation and runs the deferred sends while the radio is up
+ *
+ * @return ESP_ERR_TIMEOUT if the operation timeout had expired and the lock was released before,
+ * or the error of the lock release, then the lock is released by the power management task
+ */
+esp_err_t power_management_radio_op_end(int op_id);
+
+/**
+ * @brief Runs the network operation in the caller context, holding the active lock while it runs
+ *
+ * @return the result of the operation
+ */
+esp_err_t power_management_radio_op_run(const char * name, esp_err_t (*op)(void * arg), void * arg);
+
+/**
+ * @brief Defers the non-urgent send to the next active window
+ *
+ * If the device is active now, the send is run at once in the caller context, holding the active lock.
+ * Otherwise it is run by the radio task when the device becomes active.
+ *
+ * @return ESP_ERR_NO_MEM if POWER_MANAGEMENT_RADIO_DEFERRED_MAX sends are already deferred
+ */
+esp_err_t power_management_radio_defer(void (*send)(void * arg), void * arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // POWER_MANAGEMENT_RADIO_H
@@ -0,0 +1,158 @@
+#ifndef POWER_MANAGEMENT_TRACE_H
+#define POWER_MANAGEMENT_TRACE_H
+
+#include "power_management_defs.h"
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The record and replay of the power management inputs.
+ *
+ * While recording, every change of the sampled inputs (button, charger, woken up),
+ * every request handled by the daemon and every event emitted by the application (PMIC, battery, charger readings)
+ * is timestamped and written to the RAM ring or to the application sink (e.g. a file).
+ * The recording starts with the header: the state, the active locks, and the effective idle timeout and action
+ * as the requests, so the replay starts from the recorded state, not from the power-on.
+ *
+ * The recorded trace is fed back into the state machine by power_management_replay() on Linux host:
+ * the recorded inputs are returned instead of the real callbacks, the requests are sent and the events are emitted
+ * at their time in time-warp mode, and the resulting states timeline and the residency are returned.
+ * The virtual time jumps to the next record or the idle timeout while nothing else is pending.
+ * The runtime settings changes are not recorded.
+ */
+
+typedef enum {
+    POWER_MANAGEMENT_TRACE_RECORD_INPUTS = 0,
+    POWER_MANAGEMENT_TRACE_RECORD_REQUEST,
+    POWER_MANAGEMENT_TRACE_RECORD_EVENT,
+    POWER_MANAGEMENT_TRACE_RECORD_HEADER,
+    POWER_MANAGEMENT_TRACE_RECORD_MAX
+} power_management_trace_record_type_t;
+
+#define POWER_MANAGEMENT_TRACE_INPUT_BUTTON_PRESSED         (1 << 0)
+#define POWER_MANAGEMENT_TRACE_INPUT_CHARGER_CONNECTED      (1 << 1)
+#define POWER_MANAGEMENT_TRACE_INPUT_WOKEN_UP               (1 << 2)
+
+/**
+ * @brief The trace record, 16 bytes
+ *
+ * - timestamp_ms, timestamp_ms_hi - the low 32 and the high 8 bits of the time since the recording start
+ *
+ * - type - power_management_trace_record_type_t
+ *
+ * - id - power_management_request_type_t for REQUEST, power_management_event_t for EVENT,
+ * power_management_state_t at the recording start for HEADER
+ *
+ * - data_size - the number of the event data bytes kept in value, up to 8
+ *
+ * - value - POWER_MANAGEMENT_TRACE_INPUT_* bits for INPUTS,
+ * the inactivity time or the idle action for REQUEST, the first bytes of the event data for EVENT,
+ * the active lock count for HEADER
+ */
+typedef struct {
+    uint32_t timestamp_ms;
+    uint8_t type;
+    uint8_t id;
+    uint8_t data_size;
+    uint8_t timestamp_ms_hi;
+    uint64_t value;
+} power_management_trace_record_t;
+
+/**
+ * @brief The trace sink, called in the context of the task recording the input, request or event
+ */
+typedef void (*power_management_trace_sink_t)(const power_management_trace_record_t * record, void * arg);
+
+/**
+ * @brief The state change of the replay timeline
+ */
+typedef struct {
+    uint64_t timestamp_ms;
+    power_management_state_t state;
+} power_management_replay_transition_t;
+
+/**
+ * @brief The replay configuration
+ *
+ * - step_ms - the virtual time step while the state machine has pending timers: in INIT, SETUP,
+ * the preparation states and while the button is pressed, POWER_MANAGEMENT_INPUTS_SAMPLE_PERIOD_MS if 0.
+ * Otherwise the time jumps to the next record or to the idle timeout expiration.
+ *
+ * - tail_ms - the time replayed after the last record, e.g. to let the idle timer expire
+ *
+ * - timeline, timeline_max - the buffer for the states timeline, may be NULL
+ */
+typedef struct {
+    uint32_t step_ms;
+    uint32_t tail_ms;
+    power_management_replay_transition_t * timeline;
+    size_t timeline_max;
+} power_management_replay_config_t;
+
+/**
+ * @brief The replay result
+ *
+ * - timeline_count - the number of the timeline transitions written
+ *
+ * - residency_ms - the time spent in every state
+ *
+ * - final_state - the state at the end of the replay
+ *
+ * - duration_ms - the virtual time replayed
+ */
+typedef struct {
+    size_t timeline_count;
+    uint64_t residency_ms[POWER_MANAGEMENT_STATE_MAX];
+    power_management_state_t final_state;
+    uint64_t duration_ms;
+} power_management_replay_result_t;
+
+/**
+ * @brief Starts the recording
+ *
+ * @param sink the sink of the records, the RAM ring of POWER_MANAGEMENT_TRACE_RING_SIZE records if NULL
+ */
+esp_err_t power_management_trace_start(power_management_trace_sink_t sink, void * arg);
+
+/**
+ * @brief Stops the recording
+ */
+void power_management_trace_stop();
+
+/**
+ * @brief Get the records kept in the RAM ring, the header first and then the oldest ones
+ *
+ * @return the number of records copied
+ */
+size_t power_management_trace_get(power_management_trace_record_t * records, size_t max_records);
+
+/**
+ * @brief The sink writing the records to the file, arg is FILE *
+ */
+void power_management_trace_file_sink(const power_management_trace_record_t * record, void * arg);
+
+/**
+ * @brief Replays the trace through the power management state machine on Linux host
+ *
+ * Sets its own callbacks, enables time warp and starts the daemon, so it can be called once
+ * instead of power_management_init(). The daemon starts from the header state if it's OFF_CHARGER,
+ * SETUP, DEV_IDLE or DEV_ACTIVE, and from INIT with the first recorded inputs otherwise.
+ * The replay stops at the end of the trace and its tail, or when the device goes to sleep, shutdown or reboot.
+ *
+ * @return ESP_ERR_NOT_SUPPORTED if not built for Linux target
+ */
+esp_err_t power_management_replay(
+                                const power_management_trace_record_t * records,
+                                size_t count,
+                                const power_management_replay_config_t * config,
+                                power_management_replay_result_t * result
+                            );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // POWER_MANAGEMENT_TRACE_H
@@ -0,0 +1,90 @@
+#ifndef POWER_MANAGEMENT_UPS_H
+#define POWER_MANAGEMENT_UPS_H
+
+#include "power_management_defs.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The UPS mode for the devices powered from mains with the backup battery.
+ *
+ * The device runs with the MAINS or BATTERY profile, each with its own idle timeout and action,
+ * PMIC loop period and CPU frequency policy. The charger input is the mains presence:
+ * it's sampled every POWER_MANAGEMENT_INPUTS_SAMPLE_PERIOD_MS in any state,
+ * and the mains loss may be signalled at once from the interrupt handler (e.g. PMIC power-fail interrupt).
+ * The profile is switched only by the power management task, woken up on the signal or on the changed input.
+ * On the switch the UPS_PROFILE_CHANGED event is emitted with the hold-up time estimate.
+ */
+
+/**
+ * @brief The power profile
+ *
+ * - idle_timeout_ms, idle_action - the idle timeout and the action on its expiration,
+ * used instead of the runtime settings while the profile is active and not written to NVS,
+ * the runtime settings are used if idle_timeout_ms is 0. The profiles have a single idle timeout and action each.
+ * While the active profile has the idle timeout, the idle timeout and action setters return ESP_ERR_INVALID_STATE,
+ * and the idle fields of power_management_settings_set() are kept for the time the profile has none.
+ *
+ * - pmic_loop_period_ms - the period of the PMIC loop callback in DEV_IDLE and DEV_ACTIVE, 0 - every loop
+ *
+ * - cpu_max_freq_mhz, cpu_min_freq_mhz, cpu_light_sleep - the esp_pm configuration,
+ * applied if CONFIG_PM_ENABLE is set and cpu_max_freq_mhz is not 0
+ *
+ * - average_power_mw - the average power consumption on this profile, for the hold-up time estimate
+ */
+typedef struct {
+    uint64_t idle_timeout_ms;
+    power_management_idle_timer_expired_action_t idle_action;
+    uint32_t pmic_loop_period_ms;
+    uint16_t cpu_max_freq_mhz;
+    uint16_t cpu_min_freq_mhz;
+    bool cpu_light_sleep;
+    uint32_t average_power_mw;
+} power_management_ups_profile_t;
+
+/**
+ * @brief Enables the UPS mode with the MAINS and BATTERY profiles
+ *
+ * Call after power_management_init(). The initial profile is chosen by the charger input
+ * and applied by the power management task shortly after the call.
+ */
+esp_err_t power_management_ups_init(const power_management_ups_profile_t profiles[POWER_MANAGEMENT_UPS_PROFILE_MAX]);
+
+/**
+ * @brief Signals the mains loss, e.g. from the PMIC power-fail interrupt, without waiting for the next inputs sample
+ *
+ * Both versions wake the power management task up to switch to the BATTERY profile and request the inputs sample,
+ * the ISR version sets task_unblocked if the power management task is to be yielded to.
+ * The samples taken right after the signal may still read the charger connected, so the MAINS profile is restored
+ * when the charger input is sampled disconnected and then connected again, or still reads connected
+ * after POWER_MANAGEMENT_UPS_MAINS_LOST_HOLD_MS, e.g. after a short mains dip.
+ *
+ * @return ESP_ERR_INVALID_STATE if the UPS mode is not started
+ */
+esp_err_t power_management_ups_mains_lost();
+esp_err_t power_management_ups_mains_lost_from_isr(BaseType_t * task_unblocked);
+
+/**
+ * @brief Set the energy left in the battery, e.g. from the fuel gauge in the PMIC loop callback
+ */
+void power_management_ups_set_battery_energy(uint32_t energy_mwh);
+
+/**
+ * @brief Get the active profile
+ */
+power_management_ups_profile_id_t power_management_ups_get_profile();
+
+/**
+ * @brief Get the hold-up time estimate on the battery, 0 if unknown
+ */
+uint32_t power_management_ups_hold_up_time_s();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // POWER_MANAGEMENT_UPS_H
@@ -1,9 +1,17 @@
 #include "power_management.h"
+#include "power_management_jobs.h"
+#include "power_management_priv.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include <string.h>
+#include <inttypes.h>
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_sleep.h"
+#endif
 
 
 static const char *TAG = "PowerManagement";
@@ -19,21 +27,155 @@ static void (*_on_off_charger_setup)() = NULL;
 static void (*_on_off_charger_loop)() = NULL;
 
 static void (*_on_pmic_loop)() = NULL;
-static bool (*_on_button_state)() = NULL;
-static bool (*_on_charger_connected_state)() = NULL;
-static bool (*_on_device_woken_up)() = NULL;
 
-static uint64_t _idle_timeout_ms_set = POWER_MANAGEMENT_IDLE_TIMEOUT_MS;
+static void (*_on_device_light_sleep)() = NULL;
+
+// The wake-up data waits for the resumed state, set while it's pending
+static power_management_light_sleep_wakeup_t _light_sleep_wakeup = { 0 };
+static int64_t _light_sleep_wakeup_us = 0;
+
 static uint64_t _last_activity_millis = 0;
 static int _active_lock = 0;
 
+// Diagnostics: the current state, statistics, active lock holders and the recent events
+static portMUX_TYPE _diagnostics_mux = portMUX_INITIALIZER_UNLOCKED;
+static power_management_state_t _pm_state = POWER_MANAGEMENT_STATE_INIT;
+
+#if CONFIG_POWER_MANAGEMENT_DIAGNOSTICS
+static uint64_t _pm_state_entered_millis = 0;
+static power_management_stats_t _stats = { 0 };
+
+typedef struct {
+    TaskHandle_t task;
+    power_management_lock_holder_t holder;
+} power_management_lock_holder_slot_t;
+
+static power_management_lock_holder_slot_t _lock_holders[POWER_MANAGEMENT_LOCK_HOLDERS_MAX];
+
+// All the counters are updated under the same lock as power_management_stats_get() takes, so the snapshot is not torn
+static void power_management_stats_inc(uint32_t * counter, bool from_isr) {
+    if (from_isr) taskENTER_CRITICAL_ISR(&_diagnostics_mux);
+    else taskENTER_CRITICAL(&_diagnostics_mux);
+
+    (*counter)++;
+
+    if (from_isr) taskEXIT_CRITICAL_ISR(&_diagnostics_mux);
+    else taskEXIT_CRITICAL(&_diagnostics_mux);
+}
+
+#define POWER_MANAGEMENT_STATS_INC(field, from_isr)     power_management_stats_inc(&_stats.field, from_isr)
+#else
+#define POWER_MANAGEMENT_STATS_INC(field, from_isr)     do { } while (0)
+#endif
+
+#if POWER_MANAGEMENT_EVENT_HISTORY_SIZE > 0
+static power_management_event_record_t _event_history[POWER_MANAGEMENT_EVENT_HISTORY_SIZE];
+static size_t _event_history_head = 0;
+static size_t _event_history_count = 0;
+#endif
+
 static power_management_button_state_t _button_state = POWER_MANAGEMENT_BUTTON_STATE_RELEASED;
-static power_management_idle_timer_expired_action_t _idle_timer_expired_action = POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT;
+
+static TaskHandle_t _power_management_task = NULL;
+static TaskHandle_t _power_management_button_task = NULL;
+
+// Set by the emergency shutdown, the tasks stop themselves at the next point holding no lock
+static volatile bool _stop_requested = false;
+static SemaphoreHandle_t _tasks_stopped = NULL;
 
 static QueueHandle_t _power_management_requests_queue;
+static QueueHandle_t _power_management_urgent_requests_queue;
+
+// Configuration requests are not queued: only the latest value of each of them is kept here
+// until the power management daemon picks it up
+static portMUX_TYPE _power_management_pending_requests_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t _pending_requests_mask = 0;
+static uint64_t _pending_inactivity_time_ms = 0;
+static power_management_idle_timer_expired_action_t _pending_idle_timer_expired_action = POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT;
+static power_management_settings_t _pending_settings;
+
+#define POWER_MANAGEMENT_REQUEST_BIT(req_type) (1UL << (req_type))
+
+// The time source may be replaced, e.g. for the tests running on Linux host
+static uint64_t (*_time_source)() = NULL;
+
+// In time-warp mode the time goes only when it's advanced by power_management_time_warp_advance()
+static portMUX_TYPE _time_warp_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool _time_warp = false;
+static uint64_t _time_warp_millis = 0;
+
+// The step handshake of power_management_time_warp_step(), the button task is stepped first
+#define POWER_MANAGEMENT_TIME_WARP_TASK_BUTTON      0
+#define POWER_MANAGEMENT_TIME_WARP_TASK_DEVICE      1
+#define POWER_MANAGEMENT_TIME_WARP_TASKS            2
+
+static SemaphoreHandle_t _time_warp_step_go[POWER_MANAGEMENT_TIME_WARP_TASKS];
+static SemaphoreHandle_t _time_warp_step_done[POWER_MANAGEMENT_TIME_WARP_TASKS];
+static bool _time_warp_stepped[POWER_MANAGEMENT_TIME_WARP_TASKS];
 
 static uint64_t pm_millis() { 
-    return (uint64_t)pdTICKS_TO_MS(xTaskGetTickCount()); 
+    if (_time_warp) {
+        uint64_t millis;
+        taskENTER_CRITICAL(&_time_warp_mux);
+        millis = _time_warp_millis;
+        taskEXIT_CRITICAL(&_time_warp_mux);
+        return millis;
+    }
+
+    if (_time_source) {
+        return _time_source();
+    }
+
+    // 64-bit microseconds counter, unlike the 32-bit tick counter, never rolls over
+    return (uint64_t)(esp_timer_get_time() / 1000); 
+}
+
+// The injected time source is not trusted to be monotonic
+static uint64_t pm_elapsed_ms(uint64_t since_millis) {
+    uint64_t now_millis = pm_millis();
+    return now_millis > since_millis ? now_millis - since_millis : 0;
+}
+
+// The pause at the end of the task loop. In time-warp mode it's the step point:
+// the loop started by the step is reported done here, and the next one waits for the step up to a tick
+static void pm_loop_pause(int task) {
+    // Ended early by the notification: the inputs sample request for the button task, the UPS switch for the device one
+    if (!_time_warp) {
+        ulTaskNotifyTake(pdTRUE, 1);
+        return;
+    }
+
+    if (_time_warp_stepped[task]) {
+        _time_warp_stepped[task] = false;
+        xSemaphoreGive(_time_warp_step_done[task]);
+    }
+
+    _time_warp_stepped[task] = xSemaphoreTake(_time_warp_step_go[task], 1) == pdTRUE;
+}
+
+// Called only between the steps of the state machine, so the delay is a stop point as well,
+// and the mains loss is handled during the delay without waiting for the next step
+static void pm_delay_ms(uint32_t ms) {
+    if (_time_warp) {
+        uint64_t start_millis = pm_millis();
+        while (pm_elapsed_ms(start_millis) < ms) {
+            power_management_priv_stop_point();
+            power_management_priv_ups_poll();
+            pm_loop_pause(POWER_MANAGEMENT_TIME_WARP_TASK_DEVICE);
+        }
+        return;
+    }
+
+    TickType_t start_ticks = xTaskGetTickCount();
+    TickType_t delay_ticks = pdMS_TO_TICKS(ms);
+    TickType_t elapsed_ticks;
+
+    // Woken up by the task notification for the emergency stop and the UPS profile switch
+    while ((elapsed_ticks = xTaskGetTickCount() - start_ticks) < delay_ticks) {
+        ulTaskNotifyTake(pdTRUE, delay_ticks - elapsed_ticks);
+        power_management_priv_stop_point();
+        power_management_priv_ups_poll();
+    }
 }
 
 static void power_management_handle(void * params);
@@ -63,23 +205,73 @@ void power_management_set_off_charger_loop_cb(void (*cb)()) {
     _on_off_charger_loop = cb;
 }
 
-void power_management_set_button_cb(bool (*cb)()) {
-    _on_button_state = cb; 
+void power_management_set_loop_cb(void (*cb)()) {
+    _on_pmic_loop = cb; 
 }
 
-void power_management_set_charger_connected_cb(bool (*cb)()) {
-    _on_charger_connected_state = cb;
+void power_management_set_light_sleep_cb(void (*cb)()) {
+    _on_device_light_sleep = cb;
 }
 
-void power_management_set_device_woken_up_cb(bool (*cb)()) {
-    _on_device_woken_up = cb;
+void power_management_set_time_source_cb(uint64_t (*cb)()) {
+    _time_source = cb;
 }
 
-void power_management_set_loop_cb(void (*cb)()) {
-    _on_pmic_loop = cb; 
+uint64_t power_management_millis() {
+    return pm_millis();
+}
+
+void power_management_time_warp_set(bool enable) {
+    // Starting the virtual time from the current time, so the running timers do not expire at once
+    uint64_t millis = pm_millis();
+
+    taskENTER_CRITICAL(&_time_warp_mux);
+    if (enable && !_time_warp) _time_warp_millis = millis;
+    _time_warp = enable;
+    taskEXIT_CRITICAL(&_time_warp_mux);
+}
+
+void power_management_time_warp_advance(uint64_t ms) {
+    taskENTER_CRITICAL(&_time_warp_mux);
+    _time_warp_millis += ms;
+    taskEXIT_CRITICAL(&_time_warp_mux);
+}
+
+esp_err_t power_management_time_warp_step(uint64_t ms) {
+    if (!_time_warp || !_power_management_task || _stop_requested) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    power_management_time_warp_advance(ms);
+
+    // The button task goes first, so the device task sees the button state of the new time
+    for (int task = 0; task < POWER_MANAGEMENT_TIME_WARP_TASKS; task++) {
+        xSemaphoreGive(_time_warp_step_go[task]);
+
+        // The stopped task never finishes its loop
+        while (xSemaphoreTake(_time_warp_step_done[task], pdMS_TO_TICKS(100)) != pdTRUE) {
+            if (_stop_requested) {
+                return ESP_ERR_INVALID_STATE;
+            }
+        }
+    }
+
+    return ESP_OK;
 }
 
 esp_err_t power_management_emit_event(power_management_event_t event, void * data, size_t data_size) {
+#if POWER_MANAGEMENT_EVENT_HISTORY_SIZE > 0
+    power_management_event_record_t record = { .timestamp_ms = pm_millis(), .event = event };
+
+    taskENTER_CRITICAL(&_diagnostics_mux);
+    _event_history[_event_history_head] = record;
+    _event_history_head = (_event_history_head + 1) % POWER_MANAGEMENT_EVENT_HISTORY_SIZE;
+    if (_event_history_count < POWER_MANAGEMENT_EVENT_HISTORY_SIZE) _event_history_count++;
+    taskEXIT_CRITICAL(&_diagnostics_mux);
+#endif
+
+    power_management_priv_trace_event(event, data, data_size);
+
     return esp_event_post(POWER_MANAGEMENT_EVENT_BASE, event, data, data_size, pdMS_TO_TICKS(1000));
 }
 
@@ -107,113 +299,546 @@ esp_err_t power_management_deregister_event_handler(
     return esp_event_handler_unregister(POWER_MANAGEMENT_EVENT_BASE, event, evt_cb);
 }
 
-static void power_management_send_request(
+static bool power_management_request_is_urgent(power_management_request_type_t req_type) {
+    switch (req_type) {
+        case POWER_MANAGEMENT_REQUEST_TYPE_SLEEP:
+        case POWER_MANAGEMENT_REQUEST_TYPE_REBOOT:
+        case POWER_MANAGEMENT_REQUEST_TYPE_SHUTDOWN:
+        case POWER_MANAGEMENT_REQUEST_TYPE_POWER_ON:
+        case POWER_MANAGEMENT_REQUEST_TYPE_LIGHT_SLEEP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool power_management_request_is_coalesced(power_management_request_type_t req_type) {
+    switch (req_type) {
+        case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_RESET:
+        case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_INACTIVITY_TIME_SET:
+        case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_EXPIRED_ACTION_SET:
+        case POWER_MANAGEMENT_REQUEST_TYPE_SETTINGS_SET:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static esp_err_t power_management_send_request(
                                             power_management_request_type_t req_type, 
                                             uint64_t inactivity_time_ms, 
-                                            power_management_idle_timer_expired_action_t idle_timer_expired_action
+                                            power_management_idle_timer_expired_action_t idle_timer_expired_action,
+                                            bool from_isr,
+                                            BaseType_t * task_unblocked
                                         ) {
+    if (!_power_management_requests_queue || !_power_management_urgent_requests_queue) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Repeated configuration requests overwrite each other, so they can never fill up the queue
+    if (power_management_request_is_coalesced(req_type)) {
+        bool coalesced;
+
+        if (from_isr) taskENTER_CRITICAL_ISR(&_power_management_pending_requests_mux);
+        else taskENTER_CRITICAL(&_power_management_pending_requests_mux);
+
+        coalesced = _pending_requests_mask & POWER_MANAGEMENT_REQUEST_BIT(req_type);
+        _pending_requests_mask |= POWER_MANAGEMENT_REQUEST_BIT(req_type);
+        if (req_type == POWER_MANAGEMENT_REQUEST_TYPE_IDLE_INACTIVITY_TIME_SET) {
+            _pending_inactivity_time_ms = inactivity_time_ms;
+        }
+        else if (req_type == POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_EXPIRED_ACTION_SET) {
+            _pending_idle_timer_expired_action = idle_timer_expired_action;
+        }
+
+        if (from_isr) taskEXIT_CRITICAL_ISR(&_power_management_pending_requests_mux);
+        else taskEXIT_CRITICAL(&_power_management_pending_requests_mux);
+
+        if (coalesced) POWER_MANAGEMENT_STATS_INC(requests_coalesced, from_isr);
+
+        return ESP_OK;
+    }
+
     power_management_request_t req;
     req.request_type = req_type;
     req.inactivity_time_ms = inactivity_time_ms;
     req.idle_timer_expired_action = idle_timer_expired_action;
 
-    xQueueSend(_power_management_requests_queue, &req, 10);
+    QueueHandle_t queue = power_management_request_is_urgent(req_type) ? 
+                            _power_management_urgent_requests_queue : 
+                            _power_management_requests_queue;
+
+    BaseType_t res = from_isr ? 
+                        xQueueSendFromISR(queue, &req, task_unblocked) : 
+                        xQueueSend(queue, &req, 10);
+
+    if (res != pdTRUE) {
+        POWER_MANAGEMENT_STATS_INC(requests_dropped, from_isr);
+
+        if (!from_isr) {
+            ESP_LOGW(TAG, "Requests queue is full, request %d is dropped", req_type);
+        }
+        return ESP_ERR_TIMEOUT;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t power_management_priv_call_shutdown_cb() {
+    // The emergency shutdown may be triggered before the callbacks are set
+    if (!_on_device_shutdown) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    _on_device_shutdown();
+
+    return ESP_OK;
+}
+
+void power_management_priv_stop_point() {
+    if (!_stop_requested) {
+        return;
+    }
+
+    xSemaphoreGive(_tasks_stopped);
+    vTaskSuspend(NULL);
+}
+
+void power_management_priv_wake() {
+    if (_power_management_task) {
+        xTaskNotifyGive(_power_management_task);
+    }
+}
+
+void power_management_priv_wake_from_isr(BaseType_t * task_unblocked) {
+    if (_power_management_task) {
+        vTaskNotifyGiveFromISR(_power_management_task, task_unblocked);
+    }
+}
+
+void power_management_priv_button_wake() {
+    if (_power_management_button_task) {
+        xTaskNotifyGive(_power_management_button_task);
+    }
+}
+
+void power_management_priv_button_wake_from_isr(BaseType_t * task_unblocked) {
+    if (_power_management_button_task) {
+        vTaskNotifyGiveFromISR(_power_management_button_task, task_unblocked);
+    }
+}
+
+bool power_management_priv_stop_tasks(uint32_t timeout_ms) {
+    int tasks = 0;
+
+    _stop_requested = true;
+
+    if (!_tasks_stopped) {
+        // Power management is not started yet
+        return true;
+    }
+
+    if (_power_management_task) {
+        xTaskNotifyGive(_power_management_task);
+        tasks++;
+    }
+    if (_power_management_button_task) tasks++;
+    tasks += power_management_priv_callbacks_stop();
+
+    TickType_t start_ticks = xTaskGetTickCount();
+    TickType_t timeout_ticks = pdMS_TO_TICKS(timeout_ms);
+
+    for (; tasks > 0; tasks--) {
+        TickType_t elapsed_ticks = xTaskGetTickCount() - start_ticks;
+
+        if (elapsed_ticks >= timeout_ticks ||
+            xSemaphoreTake(_tasks_stopped, timeout_ticks - elapsed_ticks) != pdTRUE) {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 void power_management_init() {
+    power_management_priv_settings_init();
+
     assert(_on_pmic_loop);
     assert(_on_device_setup);
     assert(_on_device_reboot);
     assert(_on_device_shutdown);
     assert(_on_device_sleep);
-    assert(_on_button_state);
-    assert(_on_charger_connected_state);
-    assert(_on_device_woken_up);
+    assert(power_management_priv_inputs_ready());
     assert(_on_off_charger_setup);
     assert(_on_off_charger_loop);
 
     _power_management_requests_queue = xQueueCreate(POWER_MANAGEMENT_REQUESTS_QUEUE_SIZE, sizeof(power_management_request_t));
     assert(_power_management_requests_queue);
 
-    xTaskCreate(power_management_button_handle, "button_pm", 2048, NULL, 2, NULL);
-    xTaskCreate(power_management_handle, "device_pm", 4096, NULL, 20, NULL);
+    _power_management_urgent_requests_queue = xQueueCreate(POWER_MANAGEMENT_URGENT_REQUESTS_QUEUE_SIZE, sizeof(power_management_request_t));
+    assert(_power_management_urgent_requests_queue);
+
+    // The device, button and worker tasks
+    _tasks_stopped = xSemaphoreCreateCounting(3, 0);
+    assert(_tasks_stopped);
+
+    for (int task = 0; task < POWER_MANAGEMENT_TIME_WARP_TASKS; task++) {
+        _time_warp_step_go[task] = xSemaphoreCreateBinary();
+        _time_warp_step_done[task] = xSemaphoreCreateBinary();
+        assert(_time_warp_step_go[task] && _time_warp_step_done[task]);
+    }
+
+    power_management_priv_emergency_init();
+    power_management_priv_inputs_init();
+    power_management_priv_callbacks_init();
+    power_management_priv_subscriptions_init();
+
+    xTaskCreate(power_management_button_handle, "button_pm", 2048, NULL, 2, &_power_management_button_task);
+    xTaskCreate(power_management_handle, "device_pm", 4096, NULL, 20, &_power_management_task);
 
     ESP_LOGI(TAG, "Power management has been started");
 }
 
-void power_management_trigger_power_on() {
-    power_management_send_request(
+esp_err_t power_management_trigger_power_on() {
+    return power_management_send_request(
                                     POWER_MANAGEMENT_REQUEST_TYPE_POWER_ON, 
                                     0, 
-                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    false,
+                                    NULL
                                 );
 }
 
-void power_management_idle_reset_timer() {
-    power_management_send_request(
+esp_err_t power_management_trigger_power_on_from_isr(BaseType_t * task_unblocked) {
+    return power_management_send_request(
+                                    POWER_MANAGEMENT_REQUEST_TYPE_POWER_ON, 
+                                    0, 
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    true,
+                                    task_unblocked
+                                );
+}
+
+esp_err_t power_management_idle_reset_timer() {
+    return power_management_send_request(
                                     POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_RESET, 
                                     0, 
-                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    false,
+                                    NULL
                                 );
 }
 
-void power_management_idle_set_timeout(uint64_t timeout_ms) {
-    power_management_send_request(
+esp_err_t power_management_idle_reset_timer_from_isr(BaseType_t * task_unblocked) {
+    return power_management_send_request(
+                                    POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_RESET, 
+                                    0, 
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    true,
+                                    task_unblocked
+                                );
+}
+
+// The idle timeout of the active UPS profile would override the value set at once
+static bool power_management_idle_overridden() {
+    uint64_t timeout_ms;
+    power_management_idle_timer_expired_action_t action;
+
+    return power_management_priv_ups_idle(&timeout_ms, &action);
+}
+
+esp_err_t power_management_idle_set_timeout(uint64_t timeout_ms) {
+    if (power_management_idle_overridden()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return power_management_send_request(
                                     POWER_MANAGEMENT_REQUEST_TYPE_IDLE_INACTIVITY_TIME_SET, 
                                     timeout_ms, 
-                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    false,
+                                    NULL
                                 );
 }
 
-uint32_t power_management_idle_get_timeout() {
-    return _idle_timeout_ms_set;
+// The UPS profile overrides the idle runtime settings while it's active
+static uint64_t power_management_idle_timeout_ms() {
+    uint64_t timeout_ms;
+    power_management_idle_timer_expired_action_t action;
+
+    if (power_management_priv_ups_idle(&timeout_ms, &action)) {
+        return timeout_ms;
+    }
+
+    return power_management_priv_settings()->idle_timeout_ms;
+}
+
+power_management_idle_timer_expired_action_t power_management_priv_idle_action() {
+    uint64_t timeout_ms;
+    power_management_idle_timer_expired_action_t action;
+
+    if (power_management_priv_ups_idle(&timeout_ms, &action)) {
+        return action;
+    }
+
+    return power_management_priv_settings()->idle_timer_expired_action;
+}
+
+uint64_t power_management_idle_get_timeout() {
+    return power_management_idle_timeout_ms();
+}
+
+uint64_t power_management_idle_time_left_ms() {
+    uint64_t idle_ms = pm_elapsed_ms(_last_activity_millis);
+    uint64_t timeout_ms = power_management_idle_timeout_ms();
+
+    return idle_ms < timeout_ms ? timeout_ms - idle_ms : 0;
+}
+
+power_management_state_t power_management_get_state() {
+    return _pm_state;
 }
 
-void power_management_idle_timer_expired_action_set(power_management_idle_timer_expired_action_t action) {
-    power_management_send_request(
+void power_management_priv_initial_state_set(power_management_state_t state) {
+    _pm_state = state;
+}
+
+int power_management_active_lock_count() {
+    return _active_lock;
+}
+
+size_t power_management_active_lock_holders_get(power_management_lock_holder_t * holders, size_t max_holders) {
+    size_t count = 0;
+
+#if CONFIG_POWER_MANAGEMENT_DIAGNOSTICS
+    taskENTER_CRITICAL(&_diagnostics_mux);
+    for (size_t i = 0; i < POWER_MANAGEMENT_LOCK_HOLDERS_MAX && count < max_holders; i++) {
+        if (_lock_holders[i].holder.count > 0) {
+            holders[count++] = _lock_holders[i].holder;
+        }
+    }
+    taskEXIT_CRITICAL(&_diagnostics_mux);
+#endif
+
+    return count;
+}
+
+void power_management_stats_get(power_management_stats_t * stats) {
+#if CONFIG_POWER_MANAGEMENT_DIAGNOSTICS
+    uint64_t now_millis = pm_millis();
+
+    taskENTER_CRITICAL(&_diagnostics_mux);
+    *stats = _stats;
+    // Including the time in the current state
+    if (now_millis > _pm_state_entered_millis) {
+        stats->state_residency_ms[_pm_state] += now_millis - _pm_state_entered_millis;
+    }
+    taskEXIT_CRITICAL(&_diagnostics_mux);
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+
+    power_management_priv_callbacks_stats_get(stats);
+}
+
+size_t power_management_event_history_get(power_management_event_record_t * records, size_t max_records) {
+    size_t count = 0;
+
+#if POWER_MANAGEMENT_EVENT_HISTORY_SIZE > 0
+    taskENTER_CRITICAL(&_diagnostics_mux);
+    size_t first = (_event_history_head + POWER_MANAGEMENT_EVENT_HISTORY_SIZE - _event_history_count) % POWER_MANAGEMENT_EVENT_HISTORY_SIZE;
+    for (; count < _event_history_count && count < max_records; count++) {
+        records[count] = _event_history[(first + count) % POWER_MANAGEMENT_EVENT_HISTORY_SIZE];
+    }
+    taskEXIT_CRITICAL(&_diagnostics_mux);
+#endif
+
+    return count;
+}
+
+esp_err_t power_management_idle_timer_expired_action_set(power_management_idle_timer_expired_action_t action) {
+    if (power_management_idle_overridden()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return power_management_send_request(
                                     POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_EXPIRED_ACTION_SET, 
                                     0, 
-                                    action
+                                    action,
+                                    false,
+                                    NULL
                                 );
 }
 
-void power_management_active_lock_acquire() {
-    power_management_send_request(
+esp_err_t power_management_settings_set(const power_management_settings_t * settings) {
+    if (!settings || !power_management_priv_settings_valid(settings)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!_power_management_requests_queue) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    bool coalesced;
+
+    taskENTER_CRITICAL(&_power_management_pending_requests_mux);
+    coalesced = _pending_requests_mask & POWER_MANAGEMENT_REQUEST_BIT(POWER_MANAGEMENT_REQUEST_TYPE_SETTINGS_SET);
+    _pending_requests_mask |= POWER_MANAGEMENT_REQUEST_BIT(POWER_MANAGEMENT_REQUEST_TYPE_SETTINGS_SET);
+    _pending_settings = *settings;
+    taskEXIT_CRITICAL(&_power_management_pending_requests_mux);
+
+    if (coalesced) POWER_MANAGEMENT_STATS_INC(requests_coalesced, false);
+
+    return ESP_OK;
+}
+
+// Keeping track of the tasks holding the active lock, for diagnostics only
+static void power_management_lock_holder_update(TaskHandle_t task, int delta) {
+#if CONFIG_POWER_MANAGEMENT_DIAGNOSTICS
+    power_management_lock_holder_slot_t * slot = NULL;
+    power_management_lock_holder_slot_t * free_slot = NULL;
+
+    taskENTER_CRITICAL(&_diagnostics_mux);
+    for (size_t i = 0; i < POWER_MANAGEMENT_LOCK_HOLDERS_MAX; i++) {
+        if (_lock_holders[i].holder.count > 0 && _lock_holders[i].task == task) {
+            slot = &_lock_holders[i];
+            break;
+        }
+        if (!free_slot && _lock_holders[i].holder.count == 0) free_slot = &_lock_holders[i];
+    }
+
+    if (delta > 0 && !slot && free_slot) {
+        slot = free_slot;
+        slot->task = task;
+        strncpy(slot->holder.task_name, pcTaskGetName(task), sizeof(slot->holder.task_name) - 1);
+        slot->holder.task_name[sizeof(slot->holder.task_name) - 1] = '\0';
+    }
+
+    if (slot && (delta > 0 || slot->holder.count > 0)) {
+        slot->holder.count += delta;
+    }
+    taskEXIT_CRITICAL(&_diagnostics_mux);
+#endif
+}
+
+esp_err_t power_management_active_lock_acquire() {
+    esp_err_t err = power_management_send_request(
                                     POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_LOCK, 
                                     0, 
-                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    false,
+                                    NULL
                                 );
+
+    if (err == ESP_OK) power_management_lock_holder_update(xTaskGetCurrentTaskHandle(), 1);
+
+    return err;
 }
 
-void power_management_active_lock_release() {
-    power_management_send_request(
+esp_err_t power_management_active_lock_release() {
+    esp_err_t err = power_management_send_request(
                                     POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_UNLOCK, 
                                     0, 
-                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    false,
+                                    NULL
                                 );
+
+    if (err == ESP_OK) power_management_lock_holder_update(xTaskGetCurrentTaskHandle(), -1);
+
+    return err;
+}
+
+// The request is not queued, as the power management task would wait for its own queue
+void power_management_priv_active_lock_drop(TaskHandle_t owner) {
+    power_management_request_t req = { .request_type = POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_UNLOCK };
+
+    POWER_MANAGEMENT_STATS_INC(requests_processed, false);
+    power_management_priv_trace_request(&req);
+
+    _last_activity_millis = pm_millis();
+    if (_active_lock > 0) _active_lock--;
+
+    power_management_lock_holder_update(owner, -1);
 }
 
-void power_management_trigger_sleep() {
-    power_management_send_request(
+esp_err_t power_management_trigger_sleep() {
+    return power_management_send_request(
                                     POWER_MANAGEMENT_REQUEST_TYPE_SLEEP, 
                                     0, 
-                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    false,
+                                    NULL
+                                );
+}
+
+esp_err_t power_management_trigger_sleep_from_isr(BaseType_t * task_unblocked) {
+    return power_management_send_request(
+                                    POWER_MANAGEMENT_REQUEST_TYPE_SLEEP, 
+                                    0, 
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    true,
+                                    task_unblocked
+                                );
+}
+
+esp_err_t power_management_trigger_light_sleep() {
+    return power_management_send_request(
+                                    POWER_MANAGEMENT_REQUEST_TYPE_LIGHT_SLEEP, 
+                                    0, 
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    false,
+                                    NULL
                                 );
 }
 
-void power_management_trigger_shutdown() {
-    power_management_send_request(
+esp_err_t power_management_trigger_light_sleep_from_isr(BaseType_t * task_unblocked) {
+    return power_management_send_request(
+                                    POWER_MANAGEMENT_REQUEST_TYPE_LIGHT_SLEEP, 
+                                    0, 
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    true,
+                                    task_unblocked
+                                );
+}
+
+esp_err_t power_management_trigger_shutdown() {
+    return power_management_send_request(
+                                    POWER_MANAGEMENT_REQUEST_TYPE_SHUTDOWN, 
+                                    0, 
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    false,
+                                    NULL
+                                );
+}
+
+esp_err_t power_management_trigger_shutdown_from_isr(BaseType_t * task_unblocked) {
+    return power_management_send_request(
                                     POWER_MANAGEMENT_REQUEST_TYPE_SHUTDOWN, 
                                     0, 
-                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    true,
+                                    task_unblocked
                                 );
 }
 
-void power_management_trigger_reboot() {
-    power_management_send_request(
+esp_err_t power_management_trigger_reboot() {
+    return power_management_send_request(
                                     POWER_MANAGEMENT_REQUEST_TYPE_REBOOT, 
                                     0, 
-                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    false,
+                                    NULL
+                                );
+}
+
+esp_err_t power_management_trigger_reboot_from_isr(BaseType_t * task_unblocked) {
+    return power_management_send_request(
+                                    POWER_MANAGEMENT_REQUEST_TYPE_REBOOT, 
+                                    0, 
+                                    POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+                                    true,
+                                    task_unblocked
                                 );
 }
 
@@ -221,12 +846,17 @@ static void power_management_button_handle(void * params) {
     bool _button_state_current = false;
     bool _button_state_old = false;
     uint64_t _button_state_change_millis = 0;
+    power_management_inputs_t inputs;
 
     while(1) {
+        power_management_priv_stop_point();
+        POWER_MANAGEMENT_STATS_INC(button_loops, false);
+        power_management_priv_inputs_get(&inputs);
+
         switch(_button_state) {
             case POWER_MANAGEMENT_BUTTON_STATE_RELEASED:
                 {
-                    _button_state_current = _on_button_state();
+                    _button_state_current = inputs.button_pressed;
 
                     if (_button_state_old != _button_state_current) {
                         _button_state_old = _button_state_current;
@@ -234,7 +864,7 @@ static void power_management_button_handle(void * params) {
                         _button_state_change_millis = pm_millis();
                     }
 
-                    if (_button_state_old && (pm_millis()-_button_state_change_millis > POWER_MANAGEMENT_BUTTON_DEBOUNCE_TIME_MS)) {
+                    if (_button_state_old && (pm_elapsed_ms(_button_state_change_millis) > power_management_priv_settings()->button_debounce_time_ms)) {
                         ESP_LOGI(TAG, "Button pressed");
                         _button_state = POWER_MANAGEMENT_BUTTON_STATE_PRESSED;
 
@@ -244,7 +874,7 @@ static void power_management_button_handle(void * params) {
                 break;
             case POWER_MANAGEMENT_BUTTON_STATE_PRESSED:
                 {
-                    if (!_on_button_state()) {
+                    if (!inputs.button_pressed) {
                         ESP_LOGI(TAG, "Button clicked");
                         _button_state = POWER_MANAGEMENT_BUTTON_STATE_RELEASED;
 
@@ -257,7 +887,7 @@ static void power_management_button_handle(void * params) {
                         break;
                     }
 
-                    if (pm_millis() - _button_state_change_millis > POWER_MANAGEMENT_BUTTON_LONG_PRESS_TIME_MS) {
+                    if (pm_elapsed_ms(_button_state_change_millis) > power_management_priv_settings()->button_long_press_time_ms) {
                         ESP_LOGI(TAG, "Button long pressed");
                         _button_state = POWER_MANAGEMENT_BUTTON_STATE_LONG_PRESSED;
 
@@ -271,14 +901,14 @@ static void power_management_button_handle(void * params) {
                 break;
             case POWER_MANAGEMENT_BUTTON_STATE_LONG_PRESSED:
                 {
-                    if (!_on_button_state()) {
+                    if (!inputs.button_pressed) {
                         ESP_LOGI(TAG, "Button released from LONG_PRESSED");
                         _button_state = POWER_MANAGEMENT_BUTTON_STATE_RELEASED;
                         power_management_emit_event(POWER_MANAGEMENT_EVENT_BUTTON_RELEASED, NULL, 0);
                         break;
                     }
 
-                    if (pm_millis() - _button_state_change_millis > POWER_MANAGEMENT_BUTTON_VERY_LONG_PRESS_TIME_MS) {
+                    if (pm_elapsed_ms(_button_state_change_millis) > power_management_priv_settings()->button_very_long_press_time_ms) {
                         ESP_LOGI(TAG, "Button very long pressed");
                         _button_state = POWER_MANAGEMENT_BUTTON_STATE_VERY_LONG_PRESSED;
                         power_management_emit_event(POWER_MANAGEMENT_EVENT_BUTTON_VERY_LONG_PRESSED, NULL, 0);
@@ -291,7 +921,7 @@ static void power_management_button_handle(void * params) {
                 break;
             case POWER_MANAGEMENT_BUTTON_STATE_VERY_LONG_PRESSED:
                 {
-                    if (!_on_button_state()) {
+                    if (!inputs.button_pressed) {
                         ESP_LOGI(TAG, "Button released from VERY_LONG_PRESSED");
                         _button_state = POWER_MANAGEMENT_BUTTON_STATE_RELEASED;
                         power_management_emit_event(POWER_MANAGEMENT_EVENT_BUTTON_RELEASED, NULL, 0);
@@ -306,27 +936,260 @@ static void power_management_button_handle(void * params) {
                 break;
         }
 
-        vTaskDelay(1);
+        pm_loop_pause(POWER_MANAGEMENT_TIME_WARP_TASK_BUTTON);
     }
 
     vTaskDelete(NULL);
 }
 
+static void power_management_state_changed(power_management_state_t pm_state) {
+    power_management_state_change_t change = { .from = _pm_state, .to = pm_state };
+
+#if CONFIG_POWER_MANAGEMENT_DIAGNOSTICS
+    uint64_t now_millis = pm_millis();
+
+    taskENTER_CRITICAL(&_diagnostics_mux);
+    if (now_millis > _pm_state_entered_millis) {
+        _stats.state_residency_ms[_pm_state] += now_millis - _pm_state_entered_millis;
+    }
+    _stats.state_transitions++;
+    _pm_state = pm_state;
+    _pm_state_entered_millis = now_millis;
+    taskEXIT_CRITICAL(&_diagnostics_mux);
+#else
+    _pm_state = pm_state;
+#endif
+
+    ESP_LOGD(TAG, "State changed: %s -> %s", power_management_state_to_str(change.from), power_management_state_to_str(change.to));
+
+#if CONFIG_IDF_TARGET_LINUX
+    power_management_priv_replay_state_changed(change.from, change.to);
+#endif
+
+#if !CONFIG_POWER_MANAGEMENT_DIAGNOSTICS
+    // Without the diagnostics the event is posted only for the subscribers, e.g. the radio coordination
+    if (!power_management_priv_subscribed(POWER_MANAGEMENT_EVENT_STATE_CHANGED)) {
+        return;
+    }
+#endif
+
+    power_management_emit_event(POWER_MANAGEMENT_EVENT_STATE_CHANGED, &change, sizeof(change));
+}
+
+// Waking up once for all the periodic jobs instead of every job by its own timer
+static void power_management_jobs_arm_wakeup() {
+    uint64_t delay_ms;
+
+    if (power_management_jobs_next_wakeup(&delay_ms) != ESP_OK) {
+        return;
+    }
+
+    power_management_priv_jobs_save();
+
+    ESP_LOGD(TAG, "Next wake-up for periodic jobs in %" PRIu64 " ms", delay_ms);
+#if !CONFIG_IDF_TARGET_LINUX
+    esp_sleep_enable_timer_wakeup(delay_ms * 1000);
+#endif
+}
+
+// The PMIC is polled less often on the UPS profile with the PMIC loop period set
+static void power_management_pmic_loop() {
+    static uint64_t last_pmic_loop_millis = 0;
+    uint32_t period_ms = power_management_priv_ups_pmic_loop_period_ms();
+
+    if (period_ms && last_pmic_loop_millis && pm_elapsed_ms(last_pmic_loop_millis) < period_ms) {
+        return;
+    }
+
+    last_pmic_loop_millis = pm_millis();
+    power_management_priv_callback_run(POWER_MANAGEMENT_CALLBACK_PMIC_LOOP, _on_pmic_loop);
+}
+
+// SRAM is preserved in light sleep, so the device resumes right to IDLE/ACTIVE without SETUP
+static power_management_state_t power_management_light_sleep() {
+    ESP_LOGD(TAG, "Entering light sleep");
+    power_management_priv_callbacks_drain();
+    if (_on_device_light_sleep) _on_device_light_sleep();
+    power_management_settings_flush();
+    power_management_jobs_arm_wakeup();
+
+    memset(&_light_sleep_wakeup, 0, sizeof(_light_sleep_wakeup));
+
+    int64_t sleep_start_us = esp_timer_get_time();
+#if !CONFIG_IDF_TARGET_LINUX
+    esp_err_t err = esp_light_sleep_start();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Light sleep is rejected: %s", esp_err_to_name(err));
+    }
+#endif
+    _light_sleep_wakeup_us = esp_timer_get_time();
+#if !CONFIG_IDF_TARGET_LINUX
+    _light_sleep_wakeup.wakeup_cause = (uint32_t)esp_sleep_get_wakeup_cause();
+#endif
+
+    // The time in light sleep is not the inactivity time of the user
+    _last_activity_millis = pm_millis();
+    _light_sleep_wakeup.slept_us = _light_sleep_wakeup_us - sleep_start_us;
+
+    return _active_lock ? POWER_MANAGEMENT_STATE_DEV_ACTIVE : POWER_MANAGEMENT_STATE_DEV_IDLE;
+}
+
+// The wake-up is reported once the daemon has set the resumed state, so the latency covers the requests handled in between
+static void power_management_light_sleep_resumed() {
+    _light_sleep_wakeup.resume_latency_us = esp_timer_get_time() - _light_sleep_wakeup_us;
+    _light_sleep_wakeup_us = 0;
+
+    ESP_LOGD(
+            TAG, 
+            "Woken up from light sleep, cause %" PRIu32 ", slept %" PRIu64 " us, resumed to %s in %" PRIu64 " us", 
+            _light_sleep_wakeup.wakeup_cause, 
+            _light_sleep_wakeup.slept_us, 
+            power_management_state_to_str(_pm_state),
+            _light_sleep_wakeup.resume_latency_us
+        );
+    power_management_emit_event(POWER_MANAGEMENT_EVENT_DEVICE_LIGHT_SLEEP_WAKEUP, &_light_sleep_wakeup, sizeof(_light_sleep_wakeup));
+}
+
+static void power_management_process_request(const power_management_request_t * req, power_management_state_t * pm_state) {
+    power_management_settings_t settings;
+
+    POWER_MANAGEMENT_STATS_INC(requests_processed, false);
+    power_management_priv_trace_request(req);
+
+    switch(req->request_type) {
+        case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_RESET:
+            ESP_LOGD(TAG, "Resetting idle timer");
+            _last_activity_millis = pm_millis();
+            break;
+        case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_INACTIVITY_TIME_SET:
+            ESP_LOGD(TAG, "Setting idle inactivity time to %" PRIu64 " ms", req->inactivity_time_ms);
+            settings = *power_management_priv_settings();
+            if (req->inactivity_time_ms >= POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS)
+                settings.idle_timeout_ms = req->inactivity_time_ms;
+            else {
+                ESP_LOGW(
+                        TAG, 
+                        "The idle timeout set is too small: %" PRIu64 ", changing to %" PRIu64, 
+                        req->inactivity_time_ms, 
+                        (uint64_t)POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS
+                    );
+                settings.idle_timeout_ms = POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS;
+            }
+            power_management_priv_settings_apply(&settings, pm_millis());
+            break;
+        case POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_LOCK:
+            ESP_LOGD(TAG, "Locking device to activity");
+            _last_activity_millis = pm_millis();
+            _active_lock++;
+            break;
+        case POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_UNLOCK:
+            ESP_LOGD(TAG, "Unlocking device from activity");
+            _last_activity_millis = pm_millis();
+            _active_lock--;
+            
+            if (_active_lock < 0) _active_lock = 0;
+            break;
+        case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_EXPIRED_ACTION_SET:
+            ESP_LOGD(
+                    TAG, 
+                    "Setting idle timer expired action to %s", 
+                    power_management_idle_timer_expired_action_to_str(req->idle_timer_expired_action)
+                );
+            settings = *power_management_priv_settings();
+            settings.idle_timer_expired_action = req->idle_timer_expired_action;
+            power_management_priv_settings_apply(&settings, pm_millis());
+            break;
+        case POWER_MANAGEMENT_REQUEST_TYPE_SLEEP:
+            ESP_LOGD(TAG, "Sleep requested");
+            *pm_state = POWER_MANAGEMENT_STATE_SLEEP_PREPARE;
+            break;
+        case POWER_MANAGEMENT_REQUEST_TYPE_REBOOT:
+            ESP_LOGD(TAG, "Reboot requested");
+            *pm_state = POWER_MANAGEMENT_STATE_REBOOT_PREPARE;
+            break;
+        case POWER_MANAGEMENT_REQUEST_TYPE_SHUTDOWN:
+            ESP_LOGD(TAG, "Shutdown requested");
+            *pm_state = POWER_MANAGEMENT_STATE_SHUTDOWN_PREPARE;
+            break;
+        case POWER_MANAGEMENT_REQUEST_TYPE_POWER_ON:
+            ESP_LOGD(TAG, "Power on request");
+            if (*pm_state == POWER_MANAGEMENT_STATE_OFF_CHARGER || *pm_state == POWER_MANAGEMENT_STATE_INIT) {
+                ESP_LOGI(TAG, "Power-on called, starting");
+                *pm_state = POWER_MANAGEMENT_STATE_SETUP;
+            }
+            else {
+                ESP_LOGW(TAG, "Power-on is available only from PM_INIT or PM_OFF_CHARGE");
+            }
+            break;
+        case POWER_MANAGEMENT_REQUEST_TYPE_LIGHT_SLEEP:
+            ESP_LOGD(TAG, "Light sleep requested");
+            if (*pm_state == POWER_MANAGEMENT_STATE_DEV_IDLE || *pm_state == POWER_MANAGEMENT_STATE_DEV_ACTIVE) {
+                *pm_state = POWER_MANAGEMENT_STATE_LIGHT_SLEEP;
+            }
+            else {
+                ESP_LOGW(TAG, "Light sleep is available only from PM_DEV_IDLE or PM_DEV_ACTIVE");
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void power_management_process_pending_requests(power_management_state_t * pm_state) {
+    power_management_request_t req;
+    power_management_settings_t settings;
+    uint32_t pending_mask;
+
+    taskENTER_CRITICAL(&_power_management_pending_requests_mux);
+    pending_mask = _pending_requests_mask;
+    settings = _pending_settings;
+    req.inactivity_time_ms = _pending_inactivity_time_ms;
+    req.idle_timer_expired_action = _pending_idle_timer_expired_action;
+    _pending_requests_mask = 0;
+    taskEXIT_CRITICAL(&_power_management_pending_requests_mux);
+
+    // The whole settings are applied before the single idle timeout and idle action requests
+    if (pending_mask & POWER_MANAGEMENT_REQUEST_BIT(POWER_MANAGEMENT_REQUEST_TYPE_SETTINGS_SET)) {
+        ESP_LOGD(TAG, "Setting runtime settings");
+        POWER_MANAGEMENT_STATS_INC(requests_processed, false);
+        if (power_management_priv_settings_apply(&settings, pm_millis()) != ESP_OK) {
+            ESP_LOGW(TAG, "The runtime settings are inconsistent, ignored");
+        }
+        pending_mask &= ~POWER_MANAGEMENT_REQUEST_BIT(POWER_MANAGEMENT_REQUEST_TYPE_SETTINGS_SET);
+    }
+
+    for (int req_type = 0; req_type < POWER_MANAGEMENT_REQUEST_TYPE_MAX; req_type++) {
+        if (pending_mask & POWER_MANAGEMENT_REQUEST_BIT(req_type)) {
+            req.request_type = (power_management_request_type_t)req_type;
+            power_management_process_request(&req, pm_state);
+        }
+    }
+}
+
 static void power_management_handle(void * params) {
-    power_management_state_t pm_state = POWER_MANAGEMENT_STATE_INIT;
+    // INIT unless the replay starts from the recorded state
+    power_management_state_t pm_state = _pm_state;
     _last_activity_millis = pm_millis();
+#if CONFIG_POWER_MANAGEMENT_DIAGNOSTICS
+    _pm_state_entered_millis = pm_millis();
+#endif
     bool _idle_timer_expired_event_sent = false;
     uint64_t _init_start_millis = pm_millis();
     bool _shutdown_init_log = false;
+    bool _jobs_only_wakeup = false;
+    power_management_inputs_t inputs;
 
     while(1) {
+        power_management_priv_stop_point();
+
         switch(pm_state) {
             case POWER_MANAGEMENT_STATE_INIT:
                 {
                     ESP_LOGD(TAG, "Power management in INIT state");
+                    power_management_priv_inputs_get(&inputs);
 
                     // If in this state, button is pressed or device is waking up, turn on the device
-                    if (_on_button_state() || _on_device_woken_up()) {
+                    if (inputs.button_pressed || inputs.woken_up) {
                         ESP_LOGW(TAG, "The button is pressed or device is waking up, going to SETUP");
                         pm_state = POWER_MANAGEMENT_STATE_SETUP;
                         
@@ -334,10 +1197,10 @@ static void power_management_handle(void * params) {
                     }
 
                     // If the button not pressed but charger is connected, prepare the OFF_CHARGER state
-                    else if (_on_charger_connected_state()) {
+                    else if (inputs.charger_connected) {
                         ESP_LOGD(TAG, "Device is powered on due to charger connecting, going to OFF_CHARGER");
-                        _on_off_charger_setup();
-                        vTaskDelay(pdMS_TO_TICKS(3000));
+                        power_management_priv_callback_run(POWER_MANAGEMENT_CALLBACK_OFF_CHARGER_SETUP, _on_off_charger_setup);
+                        pm_delay_ms(3000);
                         pm_state = POWER_MANAGEMENT_STATE_OFF_CHARGER;
                         power_management_emit_event(POWER_MANAGEMENT_EVENT_OFF_CHARGER, NULL, 0);
                         break;
@@ -348,7 +1211,7 @@ static void power_management_handle(void * params) {
                     // If the time of init expired and no conditions are met, turn off the device
                     // After shutdown callback calling, the device will not be working further 
                     // until the turn on conditions are met
-                    if ((pm_millis()-_init_start_millis) > CONFIG_POWER_MANAGEMENT_INIT_WAIT_FOR_BUTTON_ACTION_MS) {
+                    if (pm_elapsed_ms(_init_start_millis) > CONFIG_POWER_MANAGEMENT_INIT_WAIT_FOR_BUTTON_ACTION_MS) {
                         if (!_shutdown_init_log) {
                             ESP_LOGW(TAG, "The device is powered by unknown reason, shutting down");
                             _shutdown_init_log = true;
@@ -361,8 +1224,10 @@ static void power_management_handle(void * params) {
                 break;
             case POWER_MANAGEMENT_STATE_OFF_CHARGER:
                 {
-                    if (_on_charger_connected_state()) {
-                        _on_off_charger_loop();
+                    power_management_priv_inputs_get(&inputs);
+
+                    if (inputs.charger_connected) {
+                        power_management_priv_callback_run(POWER_MANAGEMENT_CALLBACK_OFF_CHARGER_LOOP, _on_off_charger_loop);
 
                         // If button is long pressed in OFF_CHARGE state
                         // evaluate this as device turn on request
@@ -371,7 +1236,7 @@ static void power_management_handle(void * params) {
                             pm_state = POWER_MANAGEMENT_STATE_SETUP;
                         }
 
-                        vTaskDelay(pdMS_TO_TICKS(100));
+                        pm_delay_ms(100);
                     }
                     else {
                         ESP_LOGD(TAG, "Charger is unplugged, shutting down");
@@ -384,15 +1249,37 @@ static void power_management_handle(void * params) {
             case POWER_MANAGEMENT_STATE_SETUP:
                 {
                     ESP_LOGD(TAG, "Power management in SETUP state");
-                    _on_device_setup();
-                    vTaskDelay(pdMS_TO_TICKS(3000));
+                    power_management_priv_callback_run(POWER_MANAGEMENT_CALLBACK_SETUP, _on_device_setup);
+
+                    // Running the periodic jobs woken up for in one batch
+                    power_management_jobs_run_due();
+
+                    // Nobody is using the device woken up for the jobs only, so it goes back to sleep at once,
+                    // without the setup delay and the idle timeout
+                    if (power_management_priv_jobs_woken_up()) {
+                        power_management_priv_inputs_get(&inputs);
+
+                        // E.g. the active lock requested by the setup callback is still in the queue
+                        bool requested = uxQueueMessagesWaiting(_power_management_requests_queue) ||
+                                        uxQueueMessagesWaiting(_power_management_urgent_requests_queue);
+
+                        if (!inputs.button_pressed && !inputs.charger_connected && !_active_lock && !requested) {
+                            ESP_LOGD(TAG, "Woken up for the periodic jobs only, going back to sleep");
+                            _jobs_only_wakeup = true;
+                            pm_state = POWER_MANAGEMENT_STATE_SLEEP_PREPARE;
+                            break;
+                        }
+                    }
+
+                    pm_delay_ms(3000);
                     power_management_emit_event(POWER_MANAGEMENT_EVENT_DEVICE_SETUP_FINISHED, NULL, 0);
                     pm_state = POWER_MANAGEMENT_STATE_DEV_IDLE;
                 }
                 break;
             case POWER_MANAGEMENT_STATE_DEV_IDLE:
                 {
-                    _on_pmic_loop();
+                    power_management_pmic_loop();
+                    power_management_jobs_run_due();
 
                     // If active lock present, then set to ACTIVE state
                     if (_active_lock) {
@@ -400,14 +1287,14 @@ static void power_management_handle(void * params) {
                         pm_state = POWER_MANAGEMENT_STATE_DEV_ACTIVE;
                     }
 
-                    if (pm_millis() - _last_activity_millis > _idle_timeout_ms_set) {
+                    if (pm_elapsed_ms(_last_activity_millis) > power_management_idle_timeout_ms()) {
                         ESP_LOGD(TAG, "Idle timeout expired");
                         if (!_idle_timer_expired_event_sent) {
                             power_management_emit_event(POWER_MANAGEMENT_EVENT_IDLE_TIMER_EXPIRED, NULL, 0);
                             _idle_timer_expired_event_sent = true;
                         }
 
-                        switch(_idle_timer_expired_action) {
+                        switch(power_management_priv_idle_action()) {
                             case POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_SHUTDOWN:
                                 ESP_LOGD(TAG, "Action on idle timeout expired: SHUTDOWN");
                                 pm_state = POWER_MANAGEMENT_STATE_SHUTDOWN_PREPARE;
@@ -416,6 +1303,10 @@ static void power_management_handle(void * params) {
                                 ESP_LOGD(TAG, "Action on idle timeout expired: SLEEP");
                                 pm_state = POWER_MANAGEMENT_STATE_SLEEP_PREPARE;
                                 break;
+                            case POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_LIGHT_SLEEP:
+                                ESP_LOGD(TAG, "Action on idle timeout expired: LIGHT_SLEEP");
+                                pm_state = POWER_MANAGEMENT_STATE_LIGHT_SLEEP;
+                                break;
                             default:
                                 break;
                         }
@@ -426,7 +1317,7 @@ static void power_management_handle(void * params) {
 
                     if (_button_state == POWER_MANAGEMENT_BUTTON_STATE_VERY_LONG_PRESSED) {
                         ESP_LOGD(TAG, "The button is very-long-pressed, rebooting the device");
-                        vTaskDelay(pdMS_TO_TICKS(100));
+                        pm_delay_ms(100);
                         pm_state = POWER_MANAGEMENT_STATE_REBOOT_PREPARE;
                     }
                 }
@@ -439,13 +1330,16 @@ static void power_management_handle(void * params) {
                         pm_state = POWER_MANAGEMENT_STATE_DEV_IDLE;
                     }
 
-                    _on_pmic_loop();
+                    power_management_pmic_loop();
+                    power_management_jobs_run_due();
                 }
                 break;
             case POWER_MANAGEMENT_STATE_SHUTDOWN_PREPARE:
                 ESP_LOGD(TAG, "Preparing to shutdown the device");
                 power_management_emit_event(POWER_MANAGEMENT_EVENT_DEVICE_SHUTDOWN, NULL, 0);
-                vTaskDelay(pdMS_TO_TICKS(POWER_MANAGEMENT_EVENT_AND_ACTION_ON_SLEEP_SHUTDOWN_GAP_MS));
+                power_management_settings_flush();
+                pm_delay_ms(power_management_priv_settings()->event_and_action_gap_ms);
+                power_management_priv_callbacks_drain();
                 _on_device_shutdown();
                 // Never been reached here due to power interruption
                 break;
@@ -455,98 +1349,66 @@ static void power_management_handle(void * params) {
             case POWER_MANAGEMENT_STATE_REBOOT_PREPARE:
                 ESP_LOGD(TAG, "Preparing to reboot the device");
                 power_management_emit_event(POWER_MANAGEMENT_EVENT_DEVICE_REBOOT, NULL, 0);
-                vTaskDelay(pdMS_TO_TICKS(POWER_MANAGEMENT_EVENT_AND_ACTION_ON_SLEEP_SHUTDOWN_GAP_MS));
+                power_management_settings_flush();
+                pm_delay_ms(power_management_priv_settings()->event_and_action_gap_ms);
+                power_management_priv_callbacks_drain();
                 _on_device_reboot();
                 // Never been reached at the certain runtime
                 break;
             case POWER_MANAGEMENT_STATE_SLEEP_PREPARE:
                 ESP_LOGD(TAG, "Preparing to sleep the device");
                 power_management_emit_event(POWER_MANAGEMENT_EVENT_DEVICE_SLEEP, NULL, 0);
-                vTaskDelay(pdMS_TO_TICKS(POWER_MANAGEMENT_EVENT_AND_ACTION_ON_SLEEP_SHUTDOWN_GAP_MS));
+                power_management_settings_flush();
+                // Nothing is started for the user on the jobs wake-up, so the gap would only keep the device awake
+                if (!_jobs_only_wakeup) {
+                    pm_delay_ms(power_management_priv_settings()->event_and_action_gap_ms);
+                }
+                power_management_priv_callbacks_drain();
+                power_management_jobs_arm_wakeup();
                 _on_device_sleep();
                 // Never been reached due to power interruption the core in deep-sleep mode
                 break;
             case POWER_MANAGEMENT_STATE_SLEEP:
                 // Dummy state that never been reached
                 break;
+            case POWER_MANAGEMENT_STATE_LIGHT_SLEEP:
+                pm_state = power_management_light_sleep();
+                break;
             default:
                 break;
         }
 
-        vTaskDelay(1);
+        // In time-warp mode the step covers the whole loop, so it's paused only at the end
+        if (!_time_warp) {
+            vTaskDelay(1);
+        }
 
-        if (uxQueueMessagesWaiting(_power_management_requests_queue) > 0) {
-            power_management_request_t req;
+        power_management_request_t req;
 
-            if (xQueueReceive(_power_management_requests_queue, &req, 10) == pdTRUE) {
-                switch(req.request_type) {
-                    case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_RESET:
-                        ESP_LOGD(TAG, "Resetting idle timer");
-                        _last_activity_millis = pm_millis();
-                        break;
-                    case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_INACTIVITY_TIME_SET:
-                        ESP_LOGD(TAG, "Setting idle inactivity time to %d ms", req.inactivity_time_ms);
-                        if (req.inactivity_time_ms >= POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS)
-                            _idle_timeout_ms_set = req.inactivity_time_ms;
-                        else {
-                            ESP_LOGW(
-                                    TAG, 
-                                    "The idle timeout set is too small: %llu, changing to %llu", 
-                                    req.inactivity_time_ms, 
-                                    POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS
-                                );
-                            _idle_timeout_ms_set = POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS;
-                        }
-                        break;
-                    case POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_LOCK:
-                        ESP_LOGD(TAG, "Locking device to activity");
-                        _last_activity_millis = pm_millis();
-                        _active_lock++;
-                        break;
-                    case POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_UNLOCK:
-                        ESP_LOGD(TAG, "Unlocking device from activity");
-                        _last_activity_millis = pm_millis();
-                        _active_lock--;
-                        
-                        if (_active_lock < 0) _active_lock = 0;
-                        break;
-                    case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_EXPIRED_ACTION_SET:
-                        ESP_LOGD(
-                                TAG, 
-                                "Setting idle timer expired action to %s", 
-                                power_management_idle_timer_expired_action_to_str(req.idle_timer_expired_action)
-                            );
-                        _idle_timer_expired_action = req.idle_timer_expired_action;
-                        break;
-                    case POWER_MANAGEMENT_REQUEST_TYPE_SLEEP:
-                        ESP_LOGD(TAG, "Sleep requested");
-                        pm_state = POWER_MANAGEMENT_STATE_SLEEP_PREPARE;
-                        break;
-                    case POWER_MANAGEMENT_REQUEST_TYPE_REBOOT:
-                        ESP_LOGD(TAG, "Reboot requested");
-                        pm_state = POWER_MANAGEMENT_STATE_REBOOT_PREPARE;
-                        break;
-                    case POWER_MANAGEMENT_REQUEST_TYPE_SHUTDOWN:
-                        ESP_LOGD(TAG, "Shutdown requested");
-                        pm_state = POWER_MANAGEMENT_STATE_SHUTDOWN_PREPARE;
-                        break;
-                    case POWER_MANAGEMENT_REQUEST_TYPE_POWER_ON:
-                        ESP_LOGD(TAG, "Power on request");
-                        if (pm_state == POWER_MANAGEMENT_STATE_OFF_CHARGER || pm_state == POWER_MANAGEMENT_STATE_INIT) {
-                            ESP_LOGI(TAG, "Power-on called, starting");
-                            pm_state = POWER_MANAGEMENT_STATE_SETUP;
-                        }
-                        else {
-                            ESP_LOGW(TAG, "Power-on is available only from PM_INIT or PM_OFF_CHARGE");
-                        }
-                        break;
-                    default:
-                        break;
-                }
-            }
+        // Urgent requests are always handled first, so they cannot be stuck behind the configuration ones
+        while (xQueueReceive(_power_management_urgent_requests_queue, &req, 0) == pdTRUE) {
+            power_management_process_request(&req, &pm_state);
+        }
+
+        power_management_process_pending_requests(&pm_state);
+
+        while (xQueueReceive(_power_management_requests_queue, &req, 0) == pdTRUE) {
+            power_management_process_request(&req, &pm_state);
+        }
+
+        power_management_priv_settings_flush_if_quiet(pm_millis());
+        power_management_priv_radio_poll(pm_millis());
+        power_management_priv_ups_poll();
+
+        if (pm_state != _pm_state) {
+            power_management_state_changed(pm_state);
+        }
+        if (_light_sleep_wakeup_us) {
+            power_management_light_sleep_resumed();
         }
+        POWER_MANAGEMENT_STATS_INC(loops, false);
 
-        vTaskDelay(1);
+        pm_loop_pause(POWER_MANAGEMENT_TIME_WARP_TASK_DEVICE);
     }
 
     vTaskDelete(NULL);
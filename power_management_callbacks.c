@@ -0,0 +1,227 @@
+#include "power_management.h"
+#include "power_management_priv.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <inttypes.h>
+
+
+static const char *TAG = "PowerManagementCallbacks";
+
+#define POWER_MANAGEMENT_CALLBACKS_DRAIN_TIMEOUT_MS     1000
+#define POWER_MANAGEMENT_CALLBACKS_STOP_BIT             (1UL << 31)
+
+typedef struct {
+    uint32_t budget_ms;
+    power_management_callback_policy_t policy;
+} power_management_callback_config_t;
+
+// The setup callbacks are run once per wake-up and may init the peripherals for long, so they are not budgeted by default
+static power_management_callback_config_t _callbacks[POWER_MANAGEMENT_CALLBACK_MAX] = {
+    [POWER_MANAGEMENT_CALLBACK_SETUP] = { 0, POWER_MANAGEMENT_CALLBACK_POLICY_INLINE },
+    [POWER_MANAGEMENT_CALLBACK_PMIC_LOOP] = { POWER_MANAGEMENT_CALLBACK_BUDGET_MS, POWER_MANAGEMENT_CALLBACK_POLICY_INLINE },
+    [POWER_MANAGEMENT_CALLBACK_OFF_CHARGER_SETUP] = { 0, POWER_MANAGEMENT_CALLBACK_POLICY_INLINE },
+    [POWER_MANAGEMENT_CALLBACK_OFF_CHARGER_LOOP] = { POWER_MANAGEMENT_CALLBACK_BUDGET_MS, POWER_MANAGEMENT_CALLBACK_POLICY_INLINE },
+};
+
+static portMUX_TYPE _callbacks_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t _callback_overruns[POWER_MANAGEMENT_CALLBACK_MAX];
+static uint32_t _callback_max_duration_us[POWER_MANAGEMENT_CALLBACK_MAX];
+static bool _callback_overrunning[POWER_MANAGEMENT_CALLBACK_MAX];
+
+// Set while the callback is run by the worker, so the next call is skipped instead of queued
+static volatile bool _callback_busy[POWER_MANAGEMENT_CALLBACK_MAX];
+
+#if CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER
+static TaskHandle_t _worker_task = NULL;
+// Given by the worker after every call, so the drain wakes up to recheck the busy flags
+static SemaphoreHandle_t _worker_done = NULL;
+static void (*_worker_cbs[POWER_MANAGEMENT_CALLBACK_MAX])() = { NULL };
+#endif
+
+static bool power_management_callback_is_loop(power_management_callback_t callback) {
+    return callback == POWER_MANAGEMENT_CALLBACK_PMIC_LOOP || callback == POWER_MANAGEMENT_CALLBACK_OFF_CHARGER_LOOP;
+}
+
+static void power_management_callback_timed(power_management_callback_t callback, void (*cb)()) {
+    int64_t start_us = esp_timer_get_time();
+    cb();
+    uint64_t duration_us = esp_timer_get_time() - start_us;
+
+    uint32_t budget_ms = _callbacks[callback].budget_ms;
+    bool overrun = budget_ms > 0 && duration_us > (uint64_t)budget_ms * 1000;
+    bool overrun_started;
+
+    taskENTER_CRITICAL(&_callbacks_mux);
+    if (duration_us > _callback_max_duration_us[callback]) {
+        _callback_max_duration_us[callback] = duration_us > UINT32_MAX ? UINT32_MAX : duration_us;
+    }
+    if (overrun) _callback_overruns[callback]++;
+    overrun_started = overrun && !_callback_overrunning[callback];
+    _callback_overrunning[callback] = overrun;
+    taskEXIT_CRITICAL(&_callbacks_mux);
+
+    // The loop callback overrunning every time would flood the event loop, so only the first overrun is reported
+    if (overrun_started) {
+        power_management_callback_overrun_t data = {
+            .callback = callback,
+            .budget_ms = budget_ms,
+            .duration_us = duration_us,
+        };
+
+        ESP_LOGW(
+                TAG,
+                "Callback %s took %" PRIu64 " us, over the budget of %" PRIu32 " ms",
+                power_management_callback_to_str(callback),
+                duration_us,
+                budget_ms
+            );
+        power_management_emit_event(POWER_MANAGEMENT_EVENT_CALLBACK_OVERRUN, &data, sizeof(data));
+    }
+}
+
+#if CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER
+static void power_management_callbacks_worker(void * params) {
+    uint32_t pending;
+
+    while (1) {
+        if (xTaskNotifyWait(0, UINT32_MAX, &pending, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        power_management_priv_stop_point();
+
+        for (int callback = 0; callback < POWER_MANAGEMENT_CALLBACK_MAX; callback++) {
+            if (!(pending & (1UL << callback))) {
+                continue;
+            }
+
+            power_management_callback_timed(callback, _worker_cbs[callback]);
+            _callback_busy[callback] = false;
+            xSemaphoreGive(_worker_done);
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+#endif
+
+void power_management_priv_callbacks_init() {
+#if CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER
+    _worker_done = xSemaphoreCreateBinary();
+    assert(_worker_done);
+
+    BaseType_t res = xTaskCreate(
+                                power_management_callbacks_worker,
+                                "worker_pm",
+                                CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER_STACK_SIZE,
+                                NULL,
+                                CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER_PRIORITY,
+                                &_worker_task
+                            );
+    assert(res == pdPASS);
+#endif
+}
+
+void power_management_priv_callback_run(power_management_callback_t callback, void (*cb)()) {
+    // The previous call offloaded to the worker is not finished yet
+    if (_callback_busy[callback]) {
+        return;
+    }
+
+#if CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER
+    if (_callbacks[callback].policy == POWER_MANAGEMENT_CALLBACK_POLICY_WORKER && _worker_task) {
+        _worker_cbs[callback] = cb;
+        _callback_busy[callback] = true;
+        xTaskNotify(_worker_task, 1UL << callback, eSetBits);
+        return;
+    }
+#endif
+
+    power_management_callback_timed(callback, cb);
+}
+
+#if CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER
+static bool power_management_callbacks_busy() {
+    for (int callback = 0; callback < POWER_MANAGEMENT_CALLBACK_MAX; callback++) {
+        if (_callback_busy[callback]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+void power_management_priv_callbacks_drain() {
+#if CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER
+    if (!_worker_done) {
+        return;
+    }
+
+    TickType_t start_ticks = xTaskGetTickCount();
+    TickType_t timeout_ticks = pdMS_TO_TICKS(POWER_MANAGEMENT_CALLBACKS_DRAIN_TIMEOUT_MS);
+    TickType_t elapsed_ticks;
+
+    // Both the running call and the queued ones are waited for
+    while (power_management_callbacks_busy()) {
+        elapsed_ticks = xTaskGetTickCount() - start_ticks;
+        if (elapsed_ticks >= timeout_ticks || xSemaphoreTake(_worker_done, timeout_ticks - elapsed_ticks) != pdTRUE) {
+            ESP_LOGW(TAG, "The worker callbacks are not finished in %d ms", POWER_MANAGEMENT_CALLBACKS_DRAIN_TIMEOUT_MS);
+            return;
+        }
+    }
+#endif
+}
+
+int power_management_priv_callbacks_stop() {
+#if CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER
+    if (_worker_task) {
+        xTaskNotify(_worker_task, POWER_MANAGEMENT_CALLBACKS_STOP_BIT, eSetBits);
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+void power_management_priv_callbacks_stats_get(power_management_stats_t * stats) {
+    taskENTER_CRITICAL(&_callbacks_mux);
+    for (int callback = 0; callback < POWER_MANAGEMENT_CALLBACK_MAX; callback++) {
+        stats->callback_overruns[callback] = _callback_overruns[callback];
+        stats->callback_max_duration_us[callback] = _callback_max_duration_us[callback];
+    }
+    taskEXIT_CRITICAL(&_callbacks_mux);
+}
+
+esp_err_t power_management_callback_budget_set(
+                                            power_management_callback_t callback,
+                                            uint32_t budget_ms,
+                                            power_management_callback_policy_t policy
+                                        ) {
+    if (callback < 0 || callback >= POWER_MANAGEMENT_CALLBACK_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (policy != POWER_MANAGEMENT_CALLBACK_POLICY_INLINE && policy != POWER_MANAGEMENT_CALLBACK_POLICY_WORKER) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // The state machine goes on only after the setup callbacks are finished, so only the loop ones are offloaded
+    if (policy == POWER_MANAGEMENT_CALLBACK_POLICY_WORKER && !power_management_callback_is_loop(callback)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+#if !CONFIG_POWER_MANAGEMENT_CALLBACK_WORKER
+    if (policy == POWER_MANAGEMENT_CALLBACK_POLICY_WORKER) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#endif
+
+    _callbacks[callback].budget_ms = budget_ms;
+    _callbacks[callback].policy = policy;
+
+    return ESP_OK;
+}
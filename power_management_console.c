@@ -0,0 +1,221 @@
+#include "power_management_console.h"
+#include "power_management.h"
+#include "power_management_ups.h"
+#include "sdkconfig.h"
+#if CONFIG_POWER_MANAGEMENT_CONSOLE
+#include "esp_console.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define POWER_MANAGEMENT_CONSOLE_BENCH_MAX_S        60
+
+static int power_management_console_status() {
+    power_management_inputs_t inputs = { 0 };
+    power_management_settings_t settings;
+
+    power_management_settings_get(&settings);
+    power_management_inputs_get(&inputs);
+
+    printf("state: %s\n", power_management_state_to_str(power_management_get_state()));
+    printf("idle timeout: %" PRIu64 " ms, left: %" PRIu64 " ms\n", settings.idle_timeout_ms, power_management_idle_time_left_ms());
+    printf("idle action: %s\n", power_management_idle_timer_expired_action_to_str(settings.idle_timer_expired_action));
+    printf("active locks: %d\n", power_management_active_lock_count());
+    printf(
+        "ups profile: %s, hold-up time: %" PRIu32 " s\n",
+        power_management_ups_profile_to_str(power_management_ups_get_profile()),
+        power_management_ups_hold_up_time_s()
+    );
+    printf(
+        "inputs: button %d, charger %d, woken up %d, sampled at %" PRIu64 " ms\n",
+        inputs.button_pressed,
+        inputs.charger_connected,
+        inputs.woken_up,
+        inputs.timestamp_ms
+    );
+
+    return 0;
+}
+
+static int power_management_console_stats() {
+    power_management_stats_t stats;
+
+    power_management_stats_get(&stats);
+
+    printf("loops: %" PRIu32 ", button loops: %" PRIu32 "\n", stats.loops, stats.button_loops);
+    printf(
+        "requests: processed %" PRIu32 ", coalesced %" PRIu32 ", dropped %" PRIu32 "\n",
+        stats.requests_processed,
+        stats.requests_coalesced,
+        stats.requests_dropped
+    );
+    printf("state transitions: %" PRIu32 "\n", stats.state_transitions);
+    for (int state = 0; state < POWER_MANAGEMENT_STATE_MAX; state++) {
+        if (stats.state_residency_ms[state] > 0) {
+            printf("  %-20s %" PRIu64 " ms\n", power_management_state_to_str(state), stats.state_residency_ms[state]);
+        }
+    }
+    printf("callbacks:\n");
+    for (int callback = 0; callback < POWER_MANAGEMENT_CALLBACK_MAX; callback++) {
+        printf(
+            "  %-20s max %" PRIu32 " us, overruns %" PRIu32 "\n",
+            power_management_callback_to_str(callback),
+            stats.callback_max_duration_us[callback],
+            stats.callback_overruns[callback]
+        );
+    }
+
+    return 0;
+}
+
+static int power_management_console_locks() {
+    power_management_lock_holder_t holders[POWER_MANAGEMENT_LOCK_HOLDERS_MAX];
+    size_t count = power_management_active_lock_holders_get(holders, POWER_MANAGEMENT_LOCK_HOLDERS_MAX);
+
+    printf("active locks: %d\n", power_management_active_lock_count());
+    for (size_t i = 0; i < count; i++) {
+        printf("  %-16s %" PRIu32 "\n", holders[i].task_name, holders[i].count);
+    }
+
+    return 0;
+}
+
+static int power_management_console_trace() {
+#if POWER_MANAGEMENT_EVENT_HISTORY_SIZE > 0
+    power_management_event_record_t records[POWER_MANAGEMENT_EVENT_HISTORY_SIZE];
+    size_t count = power_management_event_history_get(records, POWER_MANAGEMENT_EVENT_HISTORY_SIZE);
+
+    for (size_t i = 0; i < count; i++) {
+        printf("%10" PRIu64 " ms %s\n", records[i].timestamp_ms, power_management_event_to_str(records[i].event));
+    }
+#else
+    printf("event history is disabled\n");
+#endif
+
+    return 0;
+}
+
+static int power_management_console_settings() {
+    power_management_settings_t settings;
+
+    power_management_settings_get(&settings);
+
+    printf("idle_timeout_ms: %" PRIu64 "\n", settings.idle_timeout_ms);
+    printf("idle_timer_expired_action: %s\n", power_management_idle_timer_expired_action_to_str(settings.idle_timer_expired_action));
+    printf("button_debounce_time_ms: %" PRIu32 "\n", settings.button_debounce_time_ms);
+    printf("button_long_press_time_ms: %" PRIu32 "\n", settings.button_long_press_time_ms);
+    printf("button_very_long_press_time_ms: %" PRIu32 "\n", settings.button_very_long_press_time_ms);
+    printf("event_and_action_gap_ms: %" PRIu32 "\n", settings.event_and_action_gap_ms);
+
+    return 0;
+}
+
+static int power_management_console_trigger(const char * target) {
+    esp_err_t err;
+
+    if (strcmp(target, "sleep") == 0) err = power_management_trigger_sleep();
+    else if (strcmp(target, "light-sleep") == 0) err = power_management_trigger_light_sleep();
+    else if (strcmp(target, "shutdown") == 0) err = power_management_trigger_shutdown();
+    else if (strcmp(target, "reboot") == 0) err = power_management_trigger_reboot();
+    else {
+        printf("unknown trigger: %s\n", target);
+        return 1;
+    }
+
+    if (err != ESP_OK) {
+        printf("request failed: %s\n", esp_err_to_name(err));
+        return 1;
+    }
+
+    return 0;
+}
+
+// The rates of the daemon loops and the inputs sampling, to see the CPU wake-ups caused by the power management itself
+static int power_management_console_bench(uint32_t seconds) {
+    power_management_stats_t before, after;
+    power_management_inputs_t inputs_before = { 0 }, inputs_after = { 0 };
+
+    power_management_stats_get(&before);
+    power_management_inputs_get(&inputs_before);
+    uint64_t start_ms = power_management_millis();
+
+    vTaskDelay(pdMS_TO_TICKS(seconds * 1000));
+
+    power_management_stats_get(&after);
+    power_management_inputs_get(&inputs_after);
+    uint64_t elapsed_ms = power_management_millis() - start_ms;
+
+    if (elapsed_ms == 0) {
+        printf("no time elapsed, time warp is enabled?\n");
+        return 1;
+    }
+
+    printf("elapsed: %" PRIu64 " ms\n", elapsed_ms);
+    printf("pm loops: %.1f /s\n", (after.loops - before.loops) * 1000.0f / elapsed_ms);
+    printf("button loops: %.1f /s\n", (after.button_loops - before.button_loops) * 1000.0f / elapsed_ms);
+    printf("inputs samples: %.1f /s\n", (inputs_after.sequence - inputs_before.sequence) * 1000.0f / elapsed_ms);
+    printf("requests: %.1f /s\n", (after.requests_processed - before.requests_processed) * 1000.0f / elapsed_ms);
+
+    return 0;
+}
+
+static int power_management_console_cmd(int argc, char ** argv) {
+    if (argc < 2 || strcmp(argv[1], "status") == 0) {
+        return power_management_console_status();
+    }
+
+    if (strcmp(argv[1], "stats") == 0) return power_management_console_stats();
+    if (strcmp(argv[1], "locks") == 0) return power_management_console_locks();
+    if (strcmp(argv[1], "trace") == 0) return power_management_console_trace();
+    if (strcmp(argv[1], "settings") == 0) return power_management_console_settings();
+
+    if (strcmp(argv[1], "set-timeout") == 0 && argc == 3) {
+        esp_err_t err = power_management_idle_set_timeout(strtoull(argv[2], NULL, 10));
+        if (err != ESP_OK) {
+            printf("request failed: %s\n", esp_err_to_name(err));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (strcmp(argv[1], "trigger") == 0 && argc == 3) {
+        return power_management_console_trigger(argv[2]);
+    }
+
+    if (strcmp(argv[1], "bench") == 0) {
+        long seconds = argc == 3 ? strtol(argv[2], NULL, 10) : 1;
+        if (seconds < 1 || seconds > POWER_MANAGEMENT_CONSOLE_BENCH_MAX_S) {
+            printf("bench duration must be 1..%d s\n", POWER_MANAGEMENT_CONSOLE_BENCH_MAX_S);
+            return 1;
+        }
+        return power_management_console_bench(seconds);
+    }
+
+    printf("unknown command, see 'help pm'\n");
+    return 1;
+}
+
+esp_err_t power_management_console_register() {
+    const esp_console_cmd_t cmd = {
+        .command = "pm",
+        .help = "Power management diagnostics: "
+                "status | stats | locks | trace | settings | set-timeout <ms> | "
+                "trigger <sleep|light-sleep|shutdown|reboot> | bench [s]",
+        .hint = NULL,
+        .func = &power_management_console_cmd,
+    };
+
+    return esp_console_cmd_register(&cmd);
+}
+
+#else
+
+esp_err_t power_management_console_register() {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
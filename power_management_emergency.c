@@ -0,0 +1,212 @@
+#include "power_management_emergency.h"
+#include "power_management_priv.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <string.h>
+#include <inttypes.h>
+
+
+static const char *TAG = "PowerManagementEmergency";
+
+#define POWER_MANAGEMENT_EMERGENCY_TRACE_MAGIC  0x504d4554
+#define POWER_MANAGEMENT_EMERGENCY_TRACE_SIZE   (4 + 3 * POWER_MANAGEMENT_EMERGENCY_HOOKS_MAX)
+
+typedef struct {
+    const char * name;
+    void (*hook)(void * arg);
+    void * arg;
+    uint32_t budget_ms;
+} power_management_emergency_hook_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    power_management_emergency_record_t records[POWER_MANAGEMENT_EMERGENCY_TRACE_SIZE];
+} power_management_emergency_trace_t;
+
+// Not initialized at the start, so the trace of the last emergency shutdown survives the restart
+static RTC_NOINIT_ATTR power_management_emergency_trace_t _emergency_trace;
+
+static power_management_emergency_hook_t _emergency_hooks[POWER_MANAGEMENT_EMERGENCY_HOOKS_MAX];
+static size_t _emergency_hooks_count = 0;
+
+static TaskHandle_t _emergency_task = NULL;
+static portMUX_TYPE _emergency_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool _emergency_triggered = false;
+
+static void power_management_emergency_record(power_management_emergency_step_t step, uint8_t hook, int64_t time_us) {
+    if (_emergency_trace.count >= POWER_MANAGEMENT_EMERGENCY_TRACE_SIZE) {
+        return;
+    }
+
+    power_management_emergency_record_t * record = &_emergency_trace.records[_emergency_trace.count];
+    record->step = step;
+    record->hook = hook;
+    record->time_us = time_us;
+    _emergency_trace.count++;
+}
+
+static void power_management_emergency_run() {
+    int64_t start_us = esp_timer_get_time();
+    int64_t budget_us = (int64_t)POWER_MANAGEMENT_EMERGENCY_BUDGET_MS * 1000;
+
+    power_management_emergency_record(POWER_MANAGEMENT_EMERGENCY_STEP_STARTED, 0, start_us);
+
+    // The power management tasks must not send events or call the callbacks any more.
+    // They are not suspended at an arbitrary point, as the hooks would block on the locks they hold.
+    bool stopped = power_management_priv_stop_tasks(POWER_MANAGEMENT_EMERGENCY_STOP_TIMEOUT_MS);
+    power_management_emergency_record(
+                                    stopped ?
+                                        POWER_MANAGEMENT_EMERGENCY_STEP_TASKS_STOPPED :
+                                        POWER_MANAGEMENT_EMERGENCY_STEP_TASKS_STOP_TIMEOUT,
+                                    0,
+                                    esp_timer_get_time()
+                                );
+
+    for (size_t i = 0; i < _emergency_hooks_count; i++) {
+        power_management_emergency_hook_t * hook = &_emergency_hooks[i];
+        int64_t hook_start_us = esp_timer_get_time();
+
+        if (hook_start_us - start_us + (int64_t)hook->budget_ms * 1000 > budget_us) {
+            power_management_emergency_record(POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_SKIPPED, i, hook_start_us);
+            continue;
+        }
+
+        power_management_emergency_record(POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_STARTED, i, hook_start_us);
+        hook->hook(hook->arg);
+
+        int64_t hook_end_us = esp_timer_get_time();
+        power_management_emergency_record(
+                                        hook_end_us - hook_start_us > (int64_t)hook->budget_ms * 1000 ?
+                                            POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_OVERRUN :
+                                            POWER_MANAGEMENT_EMERGENCY_STEP_HOOK_FINISHED,
+                                        i,
+                                        hook_end_us
+                                    );
+    }
+
+    power_management_emergency_record(POWER_MANAGEMENT_EMERGENCY_STEP_SHUTDOWN, 0, esp_timer_get_time());
+    if (power_management_priv_call_shutdown_cb() != ESP_OK) {
+        power_management_emergency_record(POWER_MANAGEMENT_EMERGENCY_STEP_NO_SHUTDOWN_CB, 0, esp_timer_get_time());
+        ESP_LOGE(TAG, "Shutdown callback is not set, cannot power off");
+    }
+    // Never been reached here because of power interruption, unless the shutdown callback is not set
+}
+
+static void power_management_emergency_handle(void * params) {
+    while (1) {
+        if (ulTaskNotifyTake(pdTRUE, portMAX_DELAY) > 0) {
+            power_management_emergency_run();
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+
+static bool power_management_emergency_start(int64_t now_us, bool from_isr) {
+    bool triggered;
+
+    if (from_isr) taskENTER_CRITICAL_ISR(&_emergency_mux);
+    else taskENTER_CRITICAL(&_emergency_mux);
+
+    triggered = _emergency_triggered;
+    _emergency_triggered = true;
+
+    if (from_isr) taskEXIT_CRITICAL_ISR(&_emergency_mux);
+    else taskEXIT_CRITICAL(&_emergency_mux);
+
+    if (triggered) {
+        return false;
+    }
+
+    _emergency_trace.count = 0;
+    _emergency_trace.magic = POWER_MANAGEMENT_EMERGENCY_TRACE_MAGIC;
+    power_management_emergency_record(POWER_MANAGEMENT_EMERGENCY_STEP_TRIGGERED, 0, now_us);
+
+    return true;
+}
+
+void power_management_priv_emergency_init() {
+    BaseType_t res = xTaskCreate(
+                                power_management_emergency_handle,
+                                "emergency_pm",
+                                POWER_MANAGEMENT_EMERGENCY_TASK_STACK_SIZE,
+                                NULL,
+                                configMAX_PRIORITIES - 1,
+                                &_emergency_task
+                            );
+    assert(res == pdPASS);
+}
+
+esp_err_t power_management_emergency_hook_register(const char * name, void (*hook)(void * arg), void * arg, uint32_t budget_ms) {
+    if (!hook) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (_emergency_hooks_count >= POWER_MANAGEMENT_EMERGENCY_HOOKS_MAX) {
+        ESP_LOGE(TAG, "Cannot register emergency hook %s, too many hooks", name ? name : "");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (budget_ms > POWER_MANAGEMENT_EMERGENCY_BUDGET_MS) {
+        ESP_LOGW(TAG, "Emergency hook %s budget %" PRIu32 " ms exceeds the total budget, it will be skipped", name ? name : "", budget_ms);
+    }
+
+    power_management_emergency_hook_t * slot = &_emergency_hooks[_emergency_hooks_count];
+    slot->name = name;
+    slot->hook = hook;
+    slot->arg = arg;
+    slot->budget_ms = budget_ms;
+    _emergency_hooks_count++;
+
+    return ESP_OK;
+}
+
+esp_err_t power_management_emergency_shutdown() {
+    if (!power_management_emergency_start(esp_timer_get_time(), false)) {
+        return ESP_OK;
+    }
+
+    ESP_LOGW(TAG, "Emergency shutdown triggered");
+
+    if (!_emergency_task) {
+        // Power management is not started yet, nothing to preempt
+        power_management_emergency_run();
+        return ESP_OK;
+    }
+
+    xTaskNotifyGive(_emergency_task);
+
+    return ESP_OK;
+}
+
+esp_err_t power_management_emergency_shutdown_from_isr(BaseType_t * task_unblocked) {
+    if (!_emergency_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (!power_management_emergency_start(esp_timer_get_time(), true)) {
+        return ESP_OK;
+    }
+
+    vTaskNotifyGiveFromISR(_emergency_task, task_unblocked);
+
+    return ESP_OK;
+}
+
+size_t power_management_emergency_get_trace(power_management_emergency_record_t * records, size_t max_records) {
+    if (!records || _emergency_trace.magic != POWER_MANAGEMENT_EMERGENCY_TRACE_MAGIC) {
+        return 0;
+    }
+
+    size_t count = _emergency_trace.count;
+    if (count > POWER_MANAGEMENT_EMERGENCY_TRACE_SIZE) count = POWER_MANAGEMENT_EMERGENCY_TRACE_SIZE;
+    if (count > max_records) count = max_records;
+
+    memcpy(records, _emergency_trace.records, count * sizeof(power_management_emergency_record_t));
+
+    return count;
+}
@@ -0,0 +1,117 @@
+#include "power_management.h"
+#include "power_management_priv.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+
+static const char *TAG = "PowerManagementInputs";
+
+static bool (*_on_button_state)() = NULL;
+static bool (*_on_charger_connected_state)() = NULL;
+static bool (*_on_device_woken_up)() = NULL;
+static void (*_on_inputs_state)(power_management_inputs_t * inputs) = NULL;
+
+// The only snapshot of the inputs shared by the button and power management tasks,
+// so the inputs (e.g. GPIO expander over I2C) are read once per sample period
+static power_management_inputs_t _inputs = { 0 };
+static SemaphoreHandle_t _inputs_mutex = NULL;
+static volatile bool _inputs_sample_requested = true;
+
+void power_management_set_button_cb(bool (*cb)()) {
+    _on_button_state = cb;
+}
+
+void power_management_set_charger_connected_cb(bool (*cb)()) {
+    _on_charger_connected_state = cb;
+}
+
+void power_management_set_device_woken_up_cb(bool (*cb)()) {
+    _on_device_woken_up = cb;
+}
+
+void power_management_set_inputs_cb(void (*cb)(power_management_inputs_t * inputs)) {
+    _on_inputs_state = cb;
+}
+
+bool power_management_priv_inputs_ready() {
+    return _on_inputs_state || (_on_button_state && _on_charger_connected_state && _on_device_woken_up);
+}
+
+void power_management_priv_inputs_init() {
+    _inputs_mutex = xSemaphoreCreateMutex();
+    assert(_inputs_mutex);
+}
+
+static void power_management_inputs_sample() {
+    power_management_inputs_t inputs = _inputs;
+
+    // All the inputs read by one call, e.g. in one bus transaction
+    if (_on_inputs_state) {
+        _on_inputs_state(&inputs);
+    }
+    else {
+        inputs.button_pressed = _on_button_state();
+        inputs.charger_connected = _on_charger_connected_state();
+        inputs.woken_up = _on_device_woken_up();
+    }
+
+    inputs.timestamp_ms = power_management_millis();
+    inputs.sequence = _inputs.sequence + 1;
+    _inputs = inputs;
+
+    power_management_priv_trace_inputs(&inputs);
+
+    ESP_LOGV(
+            TAG,
+            "Inputs sampled: button %d, charger %d, woken up %d",
+            inputs.button_pressed,
+            inputs.charger_connected,
+            inputs.woken_up
+        );
+}
+
+void power_management_priv_inputs_get(power_management_inputs_t * inputs) {
+    xSemaphoreTake(_inputs_mutex, portMAX_DELAY);
+
+    // The other task might have sampled the inputs while this one was waiting for the mutex
+    if (_inputs_sample_requested ||
+        _inputs.sequence == 0 ||
+        power_management_millis() - _inputs.timestamp_ms >= POWER_MANAGEMENT_INPUTS_SAMPLE_PERIOD_MS) {
+        _inputs_sample_requested = false;
+        power_management_inputs_sample();
+    }
+
+    *inputs = _inputs;
+
+    xSemaphoreGive(_inputs_mutex);
+
+    // Outside of the lock, as it notifies the power management task
+    power_management_priv_ups_inputs(inputs);
+}
+
+esp_err_t power_management_inputs_get(power_management_inputs_t * inputs) {
+    if (!inputs) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!_inputs_mutex) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_inputs_mutex, portMAX_DELAY);
+    *inputs = _inputs;
+    xSemaphoreGive(_inputs_mutex);
+
+    return ESP_OK;
+}
+
+void power_management_inputs_sample_request() {
+    _inputs_sample_requested = true;
+    power_management_priv_button_wake();
+}
+
+void power_management_inputs_sample_request_from_isr(BaseType_t * task_unblocked) {
+    _inputs_sample_requested = true;
+    power_management_priv_button_wake_from_isr(task_unblocked);
+}
@@ -0,0 +1,290 @@
+#include "power_management_jobs.h"
+#include "power_management.h"
+#include "power_management_priv.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include <sys/time.h>
+#include <inttypes.h>
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_sleep.h"
+#include "esp_system.h"
+#endif
+
+
+static const char *TAG = "PowerManagementJobs";
+
+#define POWER_MANAGEMENT_JOBS_MAGIC 0x504d4a42
+
+typedef struct {
+    uint32_t period_ms;
+    uint32_t tolerance_ms;
+    uint64_t next_due_ms;
+} power_management_job_slot_t;
+
+// The schedule survives the deep sleep, the callbacks are registered again at every start.
+// It's kept in the power management time, saved along with the RTC time when the wake-up is armed.
+static RTC_DATA_ATTR uint32_t _jobs_magic;
+static RTC_DATA_ATTR power_management_job_slot_t _jobs_slots[POWER_MANAGEMENT_JOBS_MAX];
+static RTC_DATA_ATTR uint64_t _jobs_saved_millis;
+static RTC_DATA_ATTR uint64_t _jobs_saved_rtc_ms;
+
+static power_management_job_config_t _jobs[POWER_MANAGEMENT_JOBS_MAX];
+static size_t _jobs_count = 0;
+static bool _jobs_restore = false;
+static bool _jobs_wakeup_checked = false;
+
+static portMUX_TYPE _jobs_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// The same time as used by all the power management timers, so the jobs follow the injected time source and time-warp
+static uint64_t pm_jobs_millis() {
+    return power_management_millis();
+}
+
+// The RTC clock keeps running in deep sleep, unlike the power management time restarting at every start
+static uint64_t pm_jobs_rtc_millis() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// The RTC memory is kept on esp_restart() and the other software resets as well,
+// while the saved time is valid only for the deep sleep the wake-up was armed for
+static bool pm_jobs_deep_sleep_reset() {
+#if CONFIG_IDF_TARGET_LINUX
+    return false;
+#else
+    return esp_reset_reason() == ESP_RST_DEEPSLEEP;
+#endif
+}
+
+// Moving the saved due time to the time of this start by the time passed since the save
+static uint64_t pm_jobs_restore_due(uint64_t next_due_ms, uint64_t now_ms) {
+    uint64_t rtc_ms = pm_jobs_rtc_millis();
+
+    // The clock may be set back, e.g. by SNTP
+    int64_t passed_ms = rtc_ms > _jobs_saved_rtc_ms ? rtc_ms - _jobs_saved_rtc_ms : 0;
+    int64_t due_ms = (int64_t)now_ms + (int64_t)(next_due_ms - _jobs_saved_millis) - passed_ms;
+
+    return due_ms > 0 ? due_ms : 0;
+}
+
+// The latest time that still meets the deadline of every job.
+// Every job whose time comes before it is run in the same wake-up.
+static uint64_t pm_jobs_plan_wakeup(const power_management_job_slot_t * slots, size_t count) {
+    uint64_t wakeup_ms = UINT64_MAX;
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t deadline_ms = slots[i].next_due_ms + slots[i].tolerance_ms;
+        if (deadline_ms < wakeup_ms) wakeup_ms = deadline_ms;
+    }
+
+    return wakeup_ms;
+}
+
+static bool pm_jobs_slot_is_due(const power_management_job_slot_t * slot, uint64_t now_ms) {
+    return slot->next_due_ms <= now_ms;
+}
+
+static void pm_jobs_slot_reschedule(power_management_job_slot_t * slot, uint64_t now_ms) {
+    // Keeping the phase, so the late runs do not accumulate the drift
+    slot->next_due_ms += slot->period_ms;
+
+    if (slot->next_due_ms <= now_ms) {
+        slot->next_due_ms = now_ms + slot->period_ms;
+    }
+}
+
+esp_err_t power_management_job_register(const power_management_job_config_t * config, int * job_id) {
+    if (!config || !config->cb || config->period_ms == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint64_t now_ms = pm_jobs_millis();
+    esp_err_t err = ESP_OK;
+    bool restored = false;
+    int id = -1;
+
+    taskENTER_CRITICAL(&_jobs_mux);
+    if (_jobs_count >= POWER_MANAGEMENT_JOBS_MAX) {
+        err = ESP_ERR_NO_MEM;
+    }
+    else {
+        // The saved schedule is valid for this start only, as the power management time restarts
+        if (_jobs_count == 0) {
+            _jobs_restore = _jobs_magic == POWER_MANAGEMENT_JOBS_MAGIC && pm_jobs_deep_sleep_reset();
+            _jobs_magic = 0;
+        }
+
+        id = _jobs_count++;
+        power_management_job_slot_t * slot = &_jobs_slots[id];
+        uint64_t next_due_ms = _jobs_restore ? pm_jobs_restore_due(slot->next_due_ms, now_ms) : 0;
+
+        restored = _jobs_restore &&
+                    slot->period_ms == config->period_ms &&
+                    slot->tolerance_ms == config->tolerance_ms &&
+                    next_due_ms <= now_ms + config->period_ms;
+
+        if (restored) {
+            slot->next_due_ms = next_due_ms;
+        }
+        else {
+            slot->period_ms = config->period_ms;
+            slot->tolerance_ms = config->tolerance_ms;
+            slot->next_due_ms = now_ms + config->period_ms;
+        }
+
+        _jobs[id] = *config;
+    }
+    taskEXIT_CRITICAL(&_jobs_mux);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot register job %s, the registry is full", config->name ? config->name : "");
+        return err;
+    }
+
+    ESP_LOGI(
+            TAG,
+            "Job %s registered: period %" PRIu32 " ms, tolerance %" PRIu32 " ms%s",
+            config->name ? config->name : "",
+            config->period_ms,
+            config->tolerance_ms,
+            restored ? ", schedule restored" : ""
+        );
+
+    if (job_id) *job_id = id;
+
+    return ESP_OK;
+}
+
+size_t power_management_jobs_run_due() {
+    uint64_t now_ms = pm_jobs_millis();
+    size_t jobs_run = 0;
+
+    for (size_t i = 0; i < _jobs_count; i++) {
+        bool due;
+
+        taskENTER_CRITICAL(&_jobs_mux);
+        due = pm_jobs_slot_is_due(&_jobs_slots[i], now_ms);
+        if (due) pm_jobs_slot_reschedule(&_jobs_slots[i], now_ms);
+        taskEXIT_CRITICAL(&_jobs_mux);
+
+        if (due) {
+            ESP_LOGD(TAG, "Running job %s", _jobs[i].name ? _jobs[i].name : "");
+            _jobs[i].cb(_jobs[i].arg);
+            jobs_run++;
+        }
+    }
+
+    return jobs_run;
+}
+
+void power_management_priv_jobs_save() {
+    if (_jobs_count == 0) {
+        return;
+    }
+
+    _jobs_saved_millis = pm_jobs_millis();
+    _jobs_saved_rtc_ms = pm_jobs_rtc_millis();
+    _jobs_magic = POWER_MANAGEMENT_JOBS_MAGIC;
+}
+
+bool power_management_priv_jobs_woken_up() {
+    bool woken_up;
+
+#if CONFIG_IDF_TARGET_LINUX
+    woken_up = false;
+#else
+    woken_up = _jobs_restore && esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER;
+#endif
+
+    // Only the first setup after the wake-up is the jobs one
+    woken_up = woken_up && !_jobs_wakeup_checked;
+    _jobs_wakeup_checked = true;
+
+    return woken_up;
+}
+
+esp_err_t power_management_jobs_next_wakeup(uint64_t * delay_ms) {
+    if (!delay_ms) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (_jobs_count == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint64_t now_ms = pm_jobs_millis();
+
+    taskENTER_CRITICAL(&_jobs_mux);
+    uint64_t wakeup_ms = pm_jobs_plan_wakeup(_jobs_slots, _jobs_count);
+    taskEXIT_CRITICAL(&_jobs_mux);
+
+    *delay_ms = wakeup_ms > now_ms ? wakeup_ms - now_ms : 0;
+
+    return ESP_OK;
+}
+
+esp_err_t power_management_jobs_simulate(
+                                        const power_management_job_config_t * jobs,
+                                        size_t jobs_count,
+                                        uint64_t duration_ms,
+                                        power_management_jobs_sim_result_t * result
+                                    ) {
+    if (!jobs || !result || jobs_count == 0 || jobs_count > POWER_MANAGEMENT_JOBS_MAX || duration_ms == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    power_management_job_slot_t slots[POWER_MANAGEMENT_JOBS_MAX];
+
+    for (size_t i = 0; i < jobs_count; i++) {
+        if (jobs[i].period_ms == 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    // Every job wakes the device up by its own timer, only the exactly matching wake-ups are shared
+    result->wakes_uncoalesced = 0;
+    for (size_t i = 0; i < jobs_count; i++) {
+        slots[i].next_due_ms = jobs[i].period_ms;
+    }
+
+    while (1) {
+        uint64_t wakeup_ms = UINT64_MAX;
+        for (size_t i = 0; i < jobs_count; i++) {
+            if (slots[i].next_due_ms < wakeup_ms) wakeup_ms = slots[i].next_due_ms;
+        }
+
+        if (wakeup_ms > duration_ms) break;
+
+        result->wakes_uncoalesced++;
+        for (size_t i = 0; i < jobs_count; i++) {
+            if (slots[i].next_due_ms == wakeup_ms) slots[i].next_due_ms += jobs[i].period_ms;
+        }
+    }
+
+    // The same planning as used before the sleep
+    result->wakes_coalesced = 0;
+    for (size_t i = 0; i < jobs_count; i++) {
+        slots[i].period_ms = jobs[i].period_ms;
+        slots[i].tolerance_ms = jobs[i].tolerance_ms;
+        slots[i].next_due_ms = jobs[i].period_ms;
+    }
+
+    while (1) {
+        uint64_t wakeup_ms = pm_jobs_plan_wakeup(slots, jobs_count);
+
+        if (wakeup_ms > duration_ms) break;
+
+        result->wakes_coalesced++;
+        for (size_t i = 0; i < jobs_count; i++) {
+            if (pm_jobs_slot_is_due(&slots[i], wakeup_ms)) pm_jobs_slot_reschedule(&slots[i], wakeup_ms);
+        }
+    }
+
+    float days = (float)duration_ms / (24.0f * 60 * 60 * 1000);
+    result->wakes_per_day_uncoalesced = result->wakes_uncoalesced / days;
+    result->wakes_per_day_coalesced = result->wakes_coalesced / days;
+
+    return ESP_OK;
+}
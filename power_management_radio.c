@@ -0,0 +1,357 @@
+#include "power_management_radio.h"
+#include "power_management.h"
+#include "power_management_priv.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#if CONFIG_POWER_MANAGEMENT_RADIO_WIFI
+#include "esp_wifi.h"
+#endif
+
+
+static const char *TAG = "PowerManagementRadio";
+
+typedef struct {
+    const char * name;
+    uint64_t deadline_ms;
+    TaskHandle_t owner;
+    bool used;
+} power_management_radio_op_t;
+
+typedef struct {
+    void (*send)(void * arg);
+    void * arg;
+} power_management_radio_send_t;
+
+static power_management_radio_backend_t _backend = { 0 };
+static bool _radio_started = false;
+static bool _modem_sleep = false;
+static TaskHandle_t _radio_task = NULL;
+
+static portMUX_TYPE _radio_mux = portMUX_INITIALIZER_UNLOCKED;
+static power_management_radio_op_t _ops[POWER_MANAGEMENT_RADIO_OPS_MAX];
+static power_management_radio_send_t _deferred[POWER_MANAGEMENT_RADIO_DEFERRED_MAX];
+static size_t _deferred_count = 0;
+
+static esp_err_t power_management_radio_stub_set_modem_sleep(bool enable, void * ctx) {
+    power_management_radio_stub_t * stub = (power_management_radio_stub_t *)ctx;
+
+    if (stub->modem_sleep != enable) stub->switches++;
+    stub->modem_sleep = enable;
+
+    return ESP_OK;
+}
+
+power_management_radio_backend_t power_management_radio_stub_backend(power_management_radio_stub_t * stub) {
+    power_management_radio_backend_t backend = {
+        .name = "stub",
+        .set_modem_sleep = power_management_radio_stub_set_modem_sleep,
+        .ctx = stub,
+    };
+
+    return backend;
+}
+
+#if CONFIG_POWER_MANAGEMENT_RADIO_WIFI
+static esp_err_t power_management_radio_wifi_set_modem_sleep(bool enable, void * ctx) {
+    // WIFI_PS_NONE is rejected when Wi-Fi and Bluetooth coexist, so the minimal modem-sleep is used when active
+    return esp_wifi_set_ps(enable ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+}
+#endif
+
+power_management_radio_backend_t power_management_radio_wifi_backend() {
+    power_management_radio_backend_t backend = {
+        .name = "wifi",
+#if CONFIG_POWER_MANAGEMENT_RADIO_WIFI
+        .set_modem_sleep = power_management_radio_wifi_set_modem_sleep,
+#endif
+    };
+
+    return backend;
+}
+
+static void power_management_radio_set_modem_sleep(bool enable) {
+    if (enable == _modem_sleep || !_backend.set_modem_sleep) {
+        return;
+    }
+
+    esp_err_t err = _backend.set_modem_sleep(enable, _backend.ctx);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot %s %s modem-sleep: %s", enable ? "enable" : "disable", _backend.name, esp_err_to_name(err));
+        return;
+    }
+
+    _modem_sleep = enable;
+    ESP_LOGD(TAG, "Modem-sleep %s", enable ? "enabled" : "disabled");
+}
+
+// Must be called while the active lock is held, so the device does not sleep mid-send
+static void power_management_radio_flush_deferred() {
+    power_management_radio_send_t sends[POWER_MANAGEMENT_RADIO_DEFERRED_MAX];
+    size_t count;
+
+    taskENTER_CRITICAL(&_radio_mux);
+    count = _deferred_count;
+    for (size_t i = 0; i < count; i++) {
+        sends[i] = _deferred[i];
+    }
+    _deferred_count = 0;
+    taskEXIT_CRITICAL(&_radio_mux);
+
+    if (count) {
+        ESP_LOGD(TAG, "Running %d deferred sends", (int)count);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        sends[i].send(sends[i].arg);
+    }
+}
+
+static void power_management_radio_lock_release() {
+    esp_err_t err = power_management_active_lock_release();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot release the active lock of the sends: %s", esp_err_to_name(err));
+    }
+}
+
+// The sends may block, so they are run by their own task, not by the event loop shared with all the subscribers
+static void power_management_radio_handle(void * params) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (_deferred_count && power_management_active_lock_acquire() == ESP_OK) {
+            power_management_radio_flush_deferred();
+            power_management_radio_lock_release();
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+
+static void power_management_radio_on_state_changed(power_management_event_t event, void * event_data, void * ctx) {
+    const power_management_state_change_t * change = (const power_management_state_change_t *)event_data;
+
+    if (!change) {
+        return;
+    }
+
+    if (change->to == POWER_MANAGEMENT_STATE_DEV_IDLE) {
+        power_management_radio_set_modem_sleep(true);
+    }
+    else if (change->to == POWER_MANAGEMENT_STATE_DEV_ACTIVE) {
+        power_management_radio_set_modem_sleep(false);
+
+        if (_deferred_count) {
+            xTaskNotifyGive(_radio_task);
+        }
+    }
+}
+
+esp_err_t power_management_radio_init(const power_management_radio_backend_t * backend) {
+    if (!backend) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (_radio_started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (!backend->set_modem_sleep) {
+        ESP_LOGW(TAG, "Backend %s cannot switch modem-sleep", backend->name ? backend->name : "");
+    }
+
+    _backend = *backend;
+    if (!_backend.name) _backend.name = "";
+
+    if (!_radio_task) {
+        BaseType_t res = xTaskCreate(
+                                    power_management_radio_handle,
+                                    "radio_pm",
+                                    CONFIG_POWER_MANAGEMENT_RADIO_TASK_STACK_SIZE,
+                                    NULL,
+                                    CONFIG_POWER_MANAGEMENT_RADIO_TASK_PRIORITY,
+                                    &_radio_task
+                                );
+        if (res != pdPASS) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    esp_err_t err = power_management_subscribe(
+                                            POWER_MANAGEMENT_EVENT_BIT(POWER_MANAGEMENT_EVENT_STATE_CHANGED),
+                                            power_management_radio_on_state_changed,
+                                            NULL,
+                                            0,
+                                            NULL
+                                        );
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    _radio_started = true;
+
+    // The device may be idle already
+    if (power_management_get_state() == POWER_MANAGEMENT_STATE_DEV_IDLE) {
+        power_management_radio_set_modem_sleep(true);
+    }
+
+    ESP_LOGI(TAG, "Radio coordination started with %s backend", _backend.name);
+
+    return ESP_OK;
+}
+
+esp_err_t power_management_radio_op_begin(const char * name, uint32_t timeout_ms, int * op_id) {
+    int id = -1;
+
+    if (!op_id) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // The injected time source is not called with the interrupts masked
+    uint64_t deadline_ms = timeout_ms ? power_management_millis() + timeout_ms : 0;
+    TaskHandle_t owner = xTaskGetCurrentTaskHandle();
+
+    taskENTER_CRITICAL(&_radio_mux);
+    for (size_t i = 0; i < POWER_MANAGEMENT_RADIO_OPS_MAX; i++) {
+        if (!_ops[i].used) {
+            id = i;
+            _ops[i].used = true;
+            _ops[i].name = name ? name : "";
+            _ops[i].deadline_ms = deadline_ms;
+            _ops[i].owner = owner;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&_radio_mux);
+
+    if (id < 0) {
+        ESP_LOGE(TAG, "Cannot begin network operation %s, too many operations", name ? name : "");
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = power_management_active_lock_acquire();
+    if (err != ESP_OK) {
+        taskENTER_CRITICAL(&_radio_mux);
+        _ops[id].used = false;
+        taskEXIT_CRITICAL(&_radio_mux);
+        return err;
+    }
+
+    *op_id = id;
+
+    return ESP_OK;
+}
+
+esp_err_t power_management_radio_op_end(int op_id) {
+    bool used;
+
+    if (op_id < 0 || op_id >= POWER_MANAGEMENT_RADIO_OPS_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    taskENTER_CRITICAL(&_radio_mux);
+    used = _ops[op_id].used;
+    taskEXIT_CRITICAL(&_radio_mux);
+
+    if (!used) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    // The radio is up and the lock is still held, the best time for the deferred sends
+    power_management_radio_flush_deferred();
+
+    taskENTER_CRITICAL(&_radio_mux);
+    used = _ops[op_id].used;
+    _ops[op_id].used = false;
+    taskEXIT_CRITICAL(&_radio_mux);
+
+    // The timeout might expire while the deferred sends were run
+    if (!used) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    esp_err_t err = power_management_active_lock_release();
+    if (err != ESP_OK) {
+        // Expiring the operation at once, so the power management task releases its lock itself
+        taskENTER_CRITICAL(&_radio_mux);
+        _ops[op_id].used = true;
+        _ops[op_id].deadline_ms = 1;
+        taskEXIT_CRITICAL(&_radio_mux);
+
+        ESP_LOGW(TAG, "Cannot release the active lock of network operation %s: %s", _ops[op_id].name, esp_err_to_name(err));
+    }
+
+    return err;
+}
+
+esp_err_t power_management_radio_op_run(const char * name, esp_err_t (*op)(void * arg), void * arg) {
+    int op_id;
+
+    if (!op) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = power_management_radio_op_begin(name, 0, &op_id);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = op(arg);
+
+    // The lock is released by the power management task if the release fails, the operation result is kept
+    power_management_radio_op_end(op_id);
+
+    return err;
+}
+
+esp_err_t power_management_radio_defer(void (*send)(void * arg), void * arg) {
+    if (!send) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // The lock keeps the device active until the send is finished
+    if (power_management_get_state() == POWER_MANAGEMENT_STATE_DEV_ACTIVE && power_management_active_lock_acquire() == ESP_OK) {
+        send(arg);
+        power_management_radio_lock_release();
+        return ESP_OK;
+    }
+
+    esp_err_t err = ESP_OK;
+
+    taskENTER_CRITICAL(&_radio_mux);
+    if (_deferred_count < POWER_MANAGEMENT_RADIO_DEFERRED_MAX) {
+        _deferred[_deferred_count].send = send;
+        _deferred[_deferred_count].arg = arg;
+        _deferred_count++;
+    }
+    else {
+        err = ESP_ERR_NO_MEM;
+    }
+    taskEXIT_CRITICAL(&_radio_mux);
+
+    return err;
+}
+
+void power_management_priv_radio_poll(uint64_t now_millis) {
+    if (!_radio_started) {
+        return;
+    }
+
+    for (size_t i = 0; i < POWER_MANAGEMENT_RADIO_OPS_MAX; i++) {
+        bool expired;
+        const char * name;
+        TaskHandle_t owner;
+
+        taskENTER_CRITICAL(&_radio_mux);
+        expired = _ops[i].used && _ops[i].deadline_ms && now_millis >= _ops[i].deadline_ms;
+        name = _ops[i].name;
+        owner = _ops[i].owner;
+        if (expired) _ops[i].used = false;
+        taskEXIT_CRITICAL(&_radio_mux);
+
+        if (expired) {
+            ESP_LOGW(TAG, "Network operation %s is not ended in time, releasing its active lock", name);
+            power_management_priv_active_lock_drop(owner);
+        }
+    }
+}
@@ -0,0 +1,161 @@
+#include "power_management.h"
+#include "power_management_priv.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#if CONFIG_POWER_MANAGEMENT_SETTINGS_NVS
+#include "nvs.h"
+#endif
+
+
+static const char *TAG = "PowerManagementSettings";
+
+#define POWER_MANAGEMENT_SETTINGS_NVS_KEY       "settings"
+#define POWER_MANAGEMENT_SETTINGS_VERSION       1
+
+typedef struct {
+    uint32_t version;
+    power_management_settings_t settings;
+} power_management_settings_blob_t;
+
+// The cache of the runtime settings. It's written to NVS only when the device goes to sleep/shutdown/reboot
+// or when the settings are not changed for the quiet period, so the flash is not worn by every change.
+static power_management_settings_t _settings = {
+    .idle_timeout_ms = POWER_MANAGEMENT_IDLE_TIMEOUT_MS,
+    .idle_timer_expired_action = POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_NOT,
+    .button_debounce_time_ms = POWER_MANAGEMENT_BUTTON_DEBOUNCE_TIME_MS,
+    .button_long_press_time_ms = POWER_MANAGEMENT_BUTTON_LONG_PRESS_TIME_MS,
+    .button_very_long_press_time_ms = POWER_MANAGEMENT_BUTTON_VERY_LONG_PRESS_TIME_MS,
+    .event_and_action_gap_ms = POWER_MANAGEMENT_EVENT_AND_ACTION_ON_SLEEP_SHUTDOWN_GAP_MS,
+};
+
+static portMUX_TYPE _settings_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool _settings_dirty = false;
+static uint64_t _settings_changed_millis = 0;
+
+bool power_management_priv_settings_valid(const power_management_settings_t * settings) {
+    return settings->idle_timeout_ms >= POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS &&
+            settings->idle_timer_expired_action <= POWER_MANAGEMENT_IDLE_TIMER_EXPIRED_ACTION_LIGHT_SLEEP &&
+            settings->button_debounce_time_ms < settings->button_long_press_time_ms &&
+            settings->button_long_press_time_ms < settings->button_very_long_press_time_ms;
+}
+
+// Comparing field by field, as the padding bytes of the structures may differ
+static bool power_management_settings_equal(const power_management_settings_t * a, const power_management_settings_t * b) {
+    return a->idle_timeout_ms == b->idle_timeout_ms &&
+            a->idle_timer_expired_action == b->idle_timer_expired_action &&
+            a->button_debounce_time_ms == b->button_debounce_time_ms &&
+            a->button_long_press_time_ms == b->button_long_press_time_ms &&
+            a->button_very_long_press_time_ms == b->button_very_long_press_time_ms &&
+            a->event_and_action_gap_ms == b->event_and_action_gap_ms;
+}
+
+void power_management_priv_settings_init() {
+#if CONFIG_POWER_MANAGEMENT_SETTINGS_NVS
+    nvs_handle_t handle;
+    power_management_settings_blob_t blob;
+    size_t blob_size = sizeof(blob);
+
+    esp_err_t err = nvs_open(CONFIG_POWER_MANAGEMENT_SETTINGS_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        // The namespace does not exist until the first flush
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGW(TAG, "Cannot open NVS, using default settings: %s", esp_err_to_name(err));
+        }
+        return;
+    }
+
+    err = nvs_get_blob(handle, POWER_MANAGEMENT_SETTINGS_NVS_KEY, &blob, &blob_size);
+    nvs_close(handle);
+
+    if (err != ESP_OK) {
+        return;
+    }
+
+    if (blob_size != sizeof(blob) || blob.version != POWER_MANAGEMENT_SETTINGS_VERSION || !power_management_priv_settings_valid(&blob.settings)) {
+        ESP_LOGW(TAG, "Stored settings are incompatible, using default settings");
+        return;
+    }
+
+    taskENTER_CRITICAL(&_settings_mux);
+    _settings = blob.settings;
+    taskEXIT_CRITICAL(&_settings_mux);
+    ESP_LOGI(TAG, "Settings are loaded from NVS");
+#endif
+}
+
+const power_management_settings_t * power_management_priv_settings() {
+    return &_settings;
+}
+
+esp_err_t power_management_priv_settings_apply(const power_management_settings_t * settings, uint64_t now_millis) {
+    if (!power_management_priv_settings_valid(settings)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (power_management_settings_equal(&_settings, settings)) {
+        return ESP_OK;
+    }
+
+    taskENTER_CRITICAL(&_settings_mux);
+    _settings = *settings;
+    _settings_dirty = true;
+    _settings_changed_millis = now_millis;
+    taskEXIT_CRITICAL(&_settings_mux);
+
+    return ESP_OK;
+}
+
+void power_management_priv_settings_flush_if_quiet(uint64_t now_millis) {
+    if (_settings_dirty && now_millis >= _settings_changed_millis + POWER_MANAGEMENT_SETTINGS_FLUSH_QUIET_MS) {
+        power_management_settings_flush();
+    }
+}
+
+void power_management_settings_get(power_management_settings_t * settings) {
+    taskENTER_CRITICAL(&_settings_mux);
+    *settings = _settings;
+    taskEXIT_CRITICAL(&_settings_mux);
+}
+
+esp_err_t power_management_settings_flush() {
+    if (!_settings_dirty) {
+        return ESP_OK;
+    }
+
+#if CONFIG_POWER_MANAGEMENT_SETTINGS_NVS
+    nvs_handle_t handle;
+    power_management_settings_blob_t blob = {
+        .version = POWER_MANAGEMENT_SETTINGS_VERSION,
+    };
+
+    // Cleared before the write, so the settings changed meanwhile are written by the next flush
+    taskENTER_CRITICAL(&_settings_mux);
+    blob.settings = _settings;
+    _settings_dirty = false;
+    taskEXIT_CRITICAL(&_settings_mux);
+
+    esp_err_t err = nvs_open(CONFIG_POWER_MANAGEMENT_SETTINGS_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, POWER_MANAGEMENT_SETTINGS_NVS_KEY, &blob, sizeof(blob));
+        if (err == ESP_OK) err = nvs_commit(handle);
+        nvs_close(handle);
+    }
+
+    if (err != ESP_OK) {
+        // Retrying after the quiet period, not on every loop while NVS is not available
+        taskENTER_CRITICAL(&_settings_mux);
+        _settings_dirty = true;
+        _settings_changed_millis = power_management_millis();
+        taskEXIT_CRITICAL(&_settings_mux);
+
+        ESP_LOGW(TAG, "Cannot write settings to NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGD(TAG, "Settings are written to NVS");
+#else
+    _settings_dirty = false;
+#endif
+
+    return ESP_OK;
+}
@@ -0,0 +1,183 @@
+#include "power_management.h"
+#include "power_management_priv.h"
+#include "esp_log.h"
+#include "esp_event.h"
+#include "freertos/FreeRTOS.h"
+
+
+static const char *TAG = "PowerManagementSubscriptions";
+
+_Static_assert(POWER_MANAGEMENT_EVENT_MAX <= 64, "The events do not fit power_management_event_mask_t");
+
+typedef struct {
+    power_management_event_mask_t events;
+    power_management_event_cb_t cb;
+    void * ctx;
+    uint8_t priority;
+    uint32_t order;
+} power_management_subscription_t;
+
+typedef struct {
+    power_management_event_cb_t cb;
+    void * ctx;
+} power_management_subscriber_t;
+
+static power_management_subscription_t _subscriptions[POWER_MANAGEMENT_SUBSCRIBERS_MAX];
+static uint32_t _subscriptions_order = 0;
+
+// The subscriptions of every event sorted by priority, updated on subscribe/unsubscribe only
+static uint8_t _event_subscribers[POWER_MANAGEMENT_EVENT_MAX][POWER_MANAGEMENT_SUBSCRIBERS_MAX];
+static uint8_t _event_subscribers_count[POWER_MANAGEMENT_EVENT_MAX];
+
+static portMUX_TYPE _subscriptions_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// The one esp_event handler of all the subscriptions
+static void power_management_subscriptions_dispatch(void * handler_arg, esp_event_base_t base, int32_t id, void * event_data) {
+    power_management_subscriber_t subscribers[POWER_MANAGEMENT_SUBSCRIBERS_MAX];
+    size_t count;
+
+    if (id < 0 || id >= POWER_MANAGEMENT_EVENT_MAX) {
+        return;
+    }
+
+    // Copied, so the handlers are called without the lock and may unsubscribe themselves
+    taskENTER_CRITICAL(&_subscriptions_mux);
+    count = _event_subscribers_count[id];
+    for (size_t i = 0; i < count; i++) {
+        power_management_subscription_t * subscription = &_subscriptions[_event_subscribers[id][i]];
+        subscribers[i].cb = subscription->cb;
+        subscribers[i].ctx = subscription->ctx;
+    }
+    taskEXIT_CRITICAL(&_subscriptions_mux);
+
+    for (size_t i = 0; i < count; i++) {
+        subscribers[i].cb((power_management_event_t)id, event_data, subscribers[i].ctx);
+    }
+}
+
+static bool power_management_subscription_before(const power_management_subscription_t * a, const power_management_subscription_t * b) {
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+    return a->order < b->order;
+}
+
+// Inserts the subscription into the sorted lists of its events only, so the interrupts are masked for a few moves.
+// Must be called with _subscriptions_mux taken
+static void power_management_subscription_link(size_t id) {
+    const power_management_subscription_t * subscription = &_subscriptions[id];
+
+    for (int event = 0; event < POWER_MANAGEMENT_EVENT_MAX; event++) {
+        if (!(subscription->events & POWER_MANAGEMENT_EVENT_BIT(event))) {
+            continue;
+        }
+
+        uint8_t * subscribers = _event_subscribers[event];
+        size_t pos = _event_subscribers_count[event];
+
+        while (pos > 0 && power_management_subscription_before(subscription, &_subscriptions[subscribers[pos - 1]])) {
+            subscribers[pos] = subscribers[pos - 1];
+            pos--;
+        }
+        subscribers[pos] = id;
+        _event_subscribers_count[event]++;
+    }
+}
+
+// Removes the subscription from the lists of its events, keeping their order.
+// Must be called with _subscriptions_mux taken
+static void power_management_subscription_unlink(size_t id) {
+    for (int event = 0; event < POWER_MANAGEMENT_EVENT_MAX; event++) {
+        if (!(_subscriptions[id].events & POWER_MANAGEMENT_EVENT_BIT(event))) {
+            continue;
+        }
+
+        uint8_t * subscribers = _event_subscribers[event];
+        size_t count = _event_subscribers_count[event];
+        size_t pos = 0;
+
+        while (pos < count && subscribers[pos] != id) pos++;
+        if (pos == count) continue;
+
+        for (; pos + 1 < count; pos++) {
+            subscribers[pos] = subscribers[pos + 1];
+        }
+        _event_subscribers_count[event]--;
+    }
+}
+
+void power_management_priv_subscriptions_init() {
+    // Registered once, the subscriptions made before are dispatched from now on
+    esp_err_t err = esp_event_handler_register(
+                                            POWER_MANAGEMENT_EVENT_BASE,
+                                            ESP_EVENT_ANY_ID,
+                                            power_management_subscriptions_dispatch,
+                                            NULL
+                                        );
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot register the events dispatcher: %s", esp_err_to_name(err));
+    }
+}
+
+esp_err_t power_management_subscribe(
+                                power_management_event_mask_t events,
+                                power_management_event_cb_t cb,
+                                void * ctx,
+                                uint8_t priority,
+                                int * subscription_id
+                            ) {
+    int id = -1;
+
+    if (!cb || !(events & POWER_MANAGEMENT_EVENT_MASK_ALL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    taskENTER_CRITICAL(&_subscriptions_mux);
+    for (size_t i = 0; i < POWER_MANAGEMENT_SUBSCRIBERS_MAX; i++) {
+        if (!_subscriptions[i].cb) {
+            id = i;
+            break;
+        }
+    }
+
+    if (id >= 0) {
+        _subscriptions[id].events = events & POWER_MANAGEMENT_EVENT_MASK_ALL;
+        _subscriptions[id].cb = cb;
+        _subscriptions[id].ctx = ctx;
+        _subscriptions[id].priority = priority;
+        _subscriptions[id].order = _subscriptions_order++;
+        power_management_subscription_link(id);
+    }
+    taskEXIT_CRITICAL(&_subscriptions_mux);
+
+    if (id < 0) {
+        ESP_LOGE(TAG, "Cannot subscribe, too many subscriptions");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (subscription_id) *subscription_id = id;
+
+    return ESP_OK;
+}
+
+esp_err_t power_management_unsubscribe(int subscription_id) {
+    if (subscription_id < 0 || subscription_id >= POWER_MANAGEMENT_SUBSCRIBERS_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    taskENTER_CRITICAL(&_subscriptions_mux);
+    bool subscribed = _subscriptions[subscription_id].cb != NULL;
+    if (subscribed) power_management_subscription_unlink(subscription_id);
+    _subscriptions[subscription_id].cb = NULL;
+    taskEXIT_CRITICAL(&_subscriptions_mux);
+
+    return subscribed ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+bool power_management_priv_subscribed(power_management_event_t event) {
+    if (event < 0 || event >= POWER_MANAGEMENT_EVENT_MAX) {
+        return false;
+    }
+
+    return _event_subscribers_count[event] > 0;
+}
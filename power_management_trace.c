@@ -0,0 +1,474 @@
+#include "power_management_trace.h"
+#include "power_management.h"
+#include "power_management_priv.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdio.h>
+#include <string.h>
+
+
+static const char *TAG = "PowerManagementTrace";
+
+static volatile bool _trace_active = false;
+static power_management_trace_sink_t _trace_sink = NULL;
+static void * _trace_arg = NULL;
+static uint64_t _trace_start_millis = 0;
+static int _trace_last_inputs = -1;
+
+#if POWER_MANAGEMENT_TRACE_RING_SIZE > 0
+static portMUX_TYPE _trace_mux = portMUX_INITIALIZER_UNLOCKED;
+static power_management_trace_record_t _trace_ring[POWER_MANAGEMENT_TRACE_RING_SIZE];
+static size_t _trace_ring_head = 0;
+static size_t _trace_ring_count = 0;
+
+// The state, the idle timeout and the idle action records
+#define POWER_MANAGEMENT_TRACE_HEADER_SIZE      3
+
+// The header is kept apart from the ring, so the replay starts from the recorded state after the ring wraps
+static power_management_trace_record_t _trace_header[POWER_MANAGEMENT_TRACE_HEADER_SIZE];
+static size_t _trace_header_count = 0;
+#endif
+
+static void power_management_trace_write(power_management_trace_record_t * record) {
+    uint64_t timestamp_ms = power_management_millis() - _trace_start_millis;
+
+    record->timestamp_ms = timestamp_ms;
+    record->timestamp_ms_hi = timestamp_ms >> 32;
+
+    if (_trace_sink) {
+        _trace_sink(record, _trace_arg);
+        return;
+    }
+
+#if POWER_MANAGEMENT_TRACE_RING_SIZE > 0
+    taskENTER_CRITICAL(&_trace_mux);
+    _trace_ring[_trace_ring_head] = *record;
+    _trace_ring_head = (_trace_ring_head + 1) % POWER_MANAGEMENT_TRACE_RING_SIZE;
+    if (_trace_ring_count < POWER_MANAGEMENT_TRACE_RING_SIZE) _trace_ring_count++;
+    taskEXIT_CRITICAL(&_trace_mux);
+#endif
+}
+
+// The events emitted by the daemon itself are the result of the state machine, not its input
+static bool power_management_trace_event_is_input(power_management_event_t event) {
+    switch (event) {
+        case POWER_MANAGEMENT_EVENT_OFF_CHARGER:
+        case POWER_MANAGEMENT_EVENT_BUTTON_RELEASED:
+        case POWER_MANAGEMENT_EVENT_BUTTON_PRESSED:
+        case POWER_MANAGEMENT_EVENT_BUTTON_CLICKED:
+        case POWER_MANAGEMENT_EVENT_BUTTON_LONG_PRESSED:
+        case POWER_MANAGEMENT_EVENT_BUTTON_VERY_LONG_PRESSED:
+        case POWER_MANAGEMENT_EVENT_IDLE_TIMER_EXPIRED:
+        case POWER_MANAGEMENT_EVENT_DEVICE_SHUTDOWN:
+        case POWER_MANAGEMENT_EVENT_DEVICE_SLEEP:
+        case POWER_MANAGEMENT_EVENT_DEVICE_REBOOT:
+        case POWER_MANAGEMENT_EVENT_DEVICE_SETUP_FINISHED:
+        case POWER_MANAGEMENT_EVENT_DEVICE_LIGHT_SLEEP_WAKEUP:
+        case POWER_MANAGEMENT_EVENT_STATE_CHANGED:
+        case POWER_MANAGEMENT_EVENT_CALLBACK_OVERRUN:
+        case POWER_MANAGEMENT_EVENT_UPS_PROFILE_CHANGED:
+            return false;
+        default:
+            return event >= 0 && event < POWER_MANAGEMENT_EVENT_MAX;
+    }
+}
+
+static void power_management_trace_write_header() {
+    power_management_trace_record_t records[] = {
+        {
+            .type = POWER_MANAGEMENT_TRACE_RECORD_HEADER,
+            .id = power_management_get_state(),
+            .value = power_management_active_lock_count(),
+        },
+        {
+            .type = POWER_MANAGEMENT_TRACE_RECORD_REQUEST,
+            .id = POWER_MANAGEMENT_REQUEST_TYPE_IDLE_INACTIVITY_TIME_SET,
+            .value = power_management_idle_get_timeout(),
+        },
+        {
+            .type = POWER_MANAGEMENT_TRACE_RECORD_REQUEST,
+            .id = POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_EXPIRED_ACTION_SET,
+            .value = power_management_priv_idle_action(),
+        },
+    };
+
+    for (size_t i = 0; i < sizeof(records) / sizeof(records[0]); i++) {
+        if (_trace_sink) {
+            _trace_sink(&records[i], _trace_arg);
+            continue;
+        }
+
+#if POWER_MANAGEMENT_TRACE_RING_SIZE > 0
+        taskENTER_CRITICAL(&_trace_mux);
+        _trace_header[_trace_header_count++] = records[i];
+        taskEXIT_CRITICAL(&_trace_mux);
+#endif
+    }
+}
+
+void power_management_priv_trace_inputs(const power_management_inputs_t * inputs) {
+    if (!_trace_active) {
+        return;
+    }
+
+    int bits = (inputs->button_pressed ? POWER_MANAGEMENT_TRACE_INPUT_BUTTON_PRESSED : 0) |
+                (inputs->charger_connected ? POWER_MANAGEMENT_TRACE_INPUT_CHARGER_CONNECTED : 0) |
+                (inputs->woken_up ? POWER_MANAGEMENT_TRACE_INPUT_WOKEN_UP : 0);
+
+    // Only the changes are recorded, the inputs are sampled every few milliseconds
+    if (bits == _trace_last_inputs) {
+        return;
+    }
+    _trace_last_inputs = bits;
+
+    power_management_trace_record_t record = {
+        .type = POWER_MANAGEMENT_TRACE_RECORD_INPUTS,
+        .value = bits,
+    };
+    power_management_trace_write(&record);
+}
+
+void power_management_priv_trace_request(const power_management_request_t * req) {
+    if (!_trace_active) {
+        return;
+    }
+
+    power_management_trace_record_t record = {
+        .type = POWER_MANAGEMENT_TRACE_RECORD_REQUEST,
+        .id = req->request_type,
+    };
+
+    if (req->request_type == POWER_MANAGEMENT_REQUEST_TYPE_IDLE_INACTIVITY_TIME_SET) {
+        record.value = req->inactivity_time_ms;
+    }
+    else if (req->request_type == POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_EXPIRED_ACTION_SET) {
+        record.value = req->idle_timer_expired_action;
+    }
+
+    power_management_trace_write(&record);
+}
+
+void power_management_priv_trace_event(power_management_event_t event, const void * data, size_t data_size) {
+    if (!_trace_active || !power_management_trace_event_is_input(event)) {
+        return;
+    }
+
+    power_management_trace_record_t record = {
+        .type = POWER_MANAGEMENT_TRACE_RECORD_EVENT,
+        .id = event,
+        .data_size = data && data_size ? (data_size < sizeof(record.value) ? data_size : sizeof(record.value)) : 0,
+    };
+    if (record.data_size) memcpy(&record.value, data, record.data_size);
+
+    power_management_trace_write(&record);
+}
+
+esp_err_t power_management_trace_start(power_management_trace_sink_t sink, void * arg) {
+#if POWER_MANAGEMENT_TRACE_RING_SIZE == 0
+    if (!sink) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#endif
+
+    if (_trace_active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+#if POWER_MANAGEMENT_TRACE_RING_SIZE > 0
+    taskENTER_CRITICAL(&_trace_mux);
+    _trace_ring_head = 0;
+    _trace_ring_count = 0;
+    _trace_header_count = 0;
+    taskEXIT_CRITICAL(&_trace_mux);
+#endif
+
+    _trace_sink = sink;
+    _trace_arg = arg;
+    _trace_start_millis = power_management_millis();
+    _trace_last_inputs = -1;
+
+    power_management_trace_write_header();
+    _trace_active = true;
+
+    // The current inputs are the first record, so the replay starts from them
+    power_management_inputs_sample_request();
+
+    ESP_LOGI(TAG, "Recording started");
+
+    return ESP_OK;
+}
+
+void power_management_trace_stop() {
+    _trace_active = false;
+}
+
+size_t power_management_trace_get(power_management_trace_record_t * records, size_t max_records) {
+    size_t count = 0;
+
+#if POWER_MANAGEMENT_TRACE_RING_SIZE > 0
+    taskENTER_CRITICAL(&_trace_mux);
+    for (; count < _trace_header_count && count < max_records; count++) {
+        records[count] = _trace_header[count];
+    }
+
+    size_t first = (_trace_ring_head + POWER_MANAGEMENT_TRACE_RING_SIZE - _trace_ring_count) % POWER_MANAGEMENT_TRACE_RING_SIZE;
+    for (size_t i = 0; i < _trace_ring_count && count < max_records; i++, count++) {
+        records[count] = _trace_ring[(first + i) % POWER_MANAGEMENT_TRACE_RING_SIZE];
+    }
+    taskEXIT_CRITICAL(&_trace_mux);
+#endif
+
+    return count;
+}
+
+void power_management_trace_file_sink(const power_management_trace_record_t * record, void * arg) {
+    FILE * file = (FILE *)arg;
+
+    if (file) {
+        fwrite(record, sizeof(*record), 1, file);
+    }
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+
+static uint8_t _replay_inputs = 0;
+static volatile bool _replay_stopped = false;
+
+// The timeline is written by the daemon at the transition itself, so the residency is credited up to it,
+// not to the end of the step the transition happened in
+static portMUX_TYPE _replay_mux = portMUX_INITIALIZER_UNLOCKED;
+static const power_management_replay_config_t * _replay_config = NULL;
+static power_management_replay_result_t * _replay_result = NULL;
+static uint64_t _replay_start_millis = 0;
+static uint64_t _replay_state_millis = 0;
+
+static void power_management_replay_noop() {}
+
+// The device would be powered off here, there is nothing to replay after
+static void power_management_replay_stop() {
+    _replay_stopped = true;
+}
+
+static void power_management_replay_inputs(power_management_inputs_t * inputs) {
+    inputs->button_pressed = _replay_inputs & POWER_MANAGEMENT_TRACE_INPUT_BUTTON_PRESSED;
+    inputs->charger_connected = _replay_inputs & POWER_MANAGEMENT_TRACE_INPUT_CHARGER_CONNECTED;
+    inputs->woken_up = _replay_inputs & POWER_MANAGEMENT_TRACE_INPUT_WOKEN_UP;
+}
+
+static void power_management_replay_apply(const power_management_trace_record_t * record) {
+    uint64_t data = record->value;
+
+    switch (record->type) {
+        case POWER_MANAGEMENT_TRACE_RECORD_HEADER:
+            for (uint64_t i = 0; i < record->value; i++) {
+                power_management_active_lock_acquire();
+            }
+            break;
+        case POWER_MANAGEMENT_TRACE_RECORD_INPUTS:
+            _replay_inputs = record->value;
+            power_management_inputs_sample_request();
+            break;
+        case POWER_MANAGEMENT_TRACE_RECORD_EVENT:
+            power_management_emit_event(record->id, record->data_size ? &data : NULL, record->data_size);
+            break;
+        case POWER_MANAGEMENT_TRACE_RECORD_REQUEST:
+            switch (record->id) {
+                case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_RESET: power_management_idle_reset_timer(); break;
+                case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_INACTIVITY_TIME_SET: power_management_idle_set_timeout(record->value); break;
+                case POWER_MANAGEMENT_REQUEST_TYPE_IDLE_TIMER_EXPIRED_ACTION_SET: power_management_idle_timer_expired_action_set(record->value); break;
+                case POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_LOCK: power_management_active_lock_acquire(); break;
+                case POWER_MANAGEMENT_REQUEST_TYPE_ACTIVE_UNLOCK: power_management_active_lock_release(); break;
+                case POWER_MANAGEMENT_REQUEST_TYPE_SLEEP: power_management_trigger_sleep(); break;
+                case POWER_MANAGEMENT_REQUEST_TYPE_REBOOT: power_management_trigger_reboot(); break;
+                case POWER_MANAGEMENT_REQUEST_TYPE_SHUTDOWN: power_management_trigger_shutdown(); break;
+                case POWER_MANAGEMENT_REQUEST_TYPE_POWER_ON: power_management_trigger_power_on(); break;
+                case POWER_MANAGEMENT_REQUEST_TYPE_LIGHT_SLEEP: power_management_trigger_light_sleep(); break;
+                default: break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void power_management_replay_transition(
+                                            const power_management_replay_config_t * config,
+                                            power_management_replay_result_t * result,
+                                            uint64_t timestamp_ms,
+                                            power_management_state_t state
+                                        ) {
+    if (config->timeline && result->timeline_count < config->timeline_max) {
+        config->timeline[result->timeline_count].timestamp_ms = timestamp_ms;
+        config->timeline[result->timeline_count].state = state;
+        result->timeline_count++;
+    }
+}
+
+void power_management_priv_replay_state_changed(power_management_state_t from, power_management_state_t to) {
+    uint64_t now_ms = power_management_millis() - _replay_start_millis;
+
+    taskENTER_CRITICAL(&_replay_mux);
+    if (_replay_result) {
+        _replay_result->residency_ms[from] += now_ms - _replay_state_millis;
+        _replay_state_millis = now_ms;
+        power_management_replay_transition(_replay_config, _replay_result, now_ms, to);
+    }
+    taskEXIT_CRITICAL(&_replay_mux);
+}
+
+static uint64_t power_management_replay_record_ms(const power_management_trace_record_t * record) {
+    return ((uint64_t)record->timestamp_ms_hi << 32) | record->timestamp_ms;
+}
+
+// The states where the state machine waits for the records or the idle timeout only
+static bool power_management_replay_settled(power_management_state_t state) {
+    if (_replay_inputs & POWER_MANAGEMENT_TRACE_INPUT_BUTTON_PRESSED) {
+        return false;
+    }
+
+    return state == POWER_MANAGEMENT_STATE_OFF_CHARGER ||
+            state == POWER_MANAGEMENT_STATE_DEV_IDLE ||
+            state == POWER_MANAGEMENT_STATE_DEV_ACTIVE;
+}
+
+static power_management_state_t power_management_replay_start_state(const power_management_trace_record_t * records, size_t count) {
+    power_management_state_t state = POWER_MANAGEMENT_STATE_INIT;
+
+    // The header and the inputs at the start of the recording are the power-on conditions
+    for (size_t i = 0; i < count && power_management_replay_record_ms(&records[i]) == 0; i++) {
+        if (records[i].type == POWER_MANAGEMENT_TRACE_RECORD_HEADER) {
+            state = records[i].id;
+        }
+        else if (records[i].type == POWER_MANAGEMENT_TRACE_RECORD_INPUTS) {
+            _replay_inputs = records[i].value;
+        }
+    }
+
+    switch (state) {
+        case POWER_MANAGEMENT_STATE_OFF_CHARGER:
+        case POWER_MANAGEMENT_STATE_SETUP:
+        case POWER_MANAGEMENT_STATE_DEV_IDLE:
+            return state;
+        case POWER_MANAGEMENT_STATE_DEV_ACTIVE:
+            // The active locks of the header bring it to DEV_ACTIVE at the first step
+            return POWER_MANAGEMENT_STATE_DEV_IDLE;
+        default:
+            return POWER_MANAGEMENT_STATE_INIT;
+    }
+}
+
+esp_err_t power_management_replay(
+                                const power_management_trace_record_t * records,
+                                size_t count,
+                                const power_management_replay_config_t * config,
+                                power_management_replay_result_t * result
+                            ) {
+    if ((!records && count) || !config || !result) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t step_ms = config->step_ms ? config->step_ms : POWER_MANAGEMENT_INPUTS_SAMPLE_PERIOD_MS;
+    uint64_t last_ms = count ? power_management_replay_record_ms(&records[count - 1]) : 0;
+    size_t next = 0;
+
+    uint64_t end_ms = last_ms + config->tail_ms;
+    uint64_t next_ms = count ? power_management_replay_record_ms(&records[0]) : 0;
+
+    memset(result, 0, sizeof(*result));
+
+    power_management_set_setup_cb(power_management_replay_noop);
+    power_management_set_loop_cb(power_management_replay_noop);
+    power_management_set_off_charger_setup_cb(power_management_replay_noop);
+    power_management_set_off_charger_loop_cb(power_management_replay_noop);
+    power_management_set_sleep_cb(power_management_replay_stop);
+    power_management_set_shutdown_cb(power_management_replay_stop);
+    power_management_set_reboot_cb(power_management_replay_stop);
+    power_management_set_inputs_cb(power_management_replay_inputs);
+
+    power_management_priv_initial_state_set(power_management_replay_start_state(records, count));
+
+    power_management_time_warp_set(true);
+
+    _replay_config = config;
+    _replay_result = result;
+    _replay_start_millis = power_management_millis();
+    _replay_state_millis = 0;
+    power_management_replay_transition(config, result, 0, power_management_get_state());
+
+    power_management_init();
+
+    uint64_t now_ms = 0;
+    uint64_t advance_ms = 0;
+
+    while (!_replay_stopped) {
+        bool applied = false;
+
+        while (next < count && next_ms <= now_ms) {
+            power_management_replay_apply(&records[next++]);
+            if (next < count) next_ms = power_management_replay_record_ms(&records[next]);
+            applied = true;
+        }
+
+        // The tasks handle the new time and the records applied at it before the step returns,
+        // and the state machine reacts to the handled requests at the next loop
+        esp_err_t err = power_management_time_warp_step(advance_ms);
+        if (err == ESP_OK && applied) {
+            err = power_management_time_warp_step(0);
+        }
+        if (err != ESP_OK) {
+            break;
+        }
+
+        if (now_ms >= end_ms) {
+            break;
+        }
+
+        power_management_state_t state = power_management_get_state();
+
+        advance_ms = step_ms;
+        if (power_management_replay_settled(state)) {
+            advance_ms = end_ms - now_ms;
+
+            // Just past the idle timeout, as it expires when the idle time is over it
+            uint64_t idle_left_ms = power_management_idle_time_left_ms();
+            if (state == POWER_MANAGEMENT_STATE_DEV_IDLE && idle_left_ms && idle_left_ms + 1 < advance_ms) {
+                advance_ms = idle_left_ms + 1;
+            }
+        }
+
+        if (next < count && next_ms - now_ms < advance_ms) {
+            advance_ms = next_ms - now_ms;
+        }
+        if (end_ms - now_ms < advance_ms) {
+            advance_ms = end_ms - now_ms;
+        }
+
+        now_ms += advance_ms;
+    }
+
+    // The daemon keeps running, but the result is not written after the return
+    uint64_t replay_ms = power_management_millis() - _replay_start_millis;
+
+    taskENTER_CRITICAL(&_replay_mux);
+    result->final_state = power_management_get_state();
+    result->residency_ms[result->final_state] += replay_ms - _replay_state_millis;
+    result->duration_ms = replay_ms;
+    _replay_result = NULL;
+    taskEXIT_CRITICAL(&_replay_mux);
+
+    return ESP_OK;
+}
+
+#else
+
+esp_err_t power_management_replay(
+                                const power_management_trace_record_t * records,
+                                size_t count,
+                                const power_management_replay_config_t * config,
+                                power_management_replay_result_t * result
+                            ) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
@@ -0,0 +1,213 @@
+#include "power_management_ups.h"
+#include "power_management.h"
+#include "power_management_priv.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include <inttypes.h>
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+
+static const char *TAG = "PowerManagementUps";
+
+static power_management_ups_profile_t _profiles[POWER_MANAGEMENT_UPS_PROFILE_MAX];
+static volatile bool _ups_started = false;
+
+static volatile power_management_ups_profile_id_t _profile = POWER_MANAGEMENT_UPS_PROFILE_MAX;
+static volatile bool _mains_lost_pending = false;
+static volatile uint32_t _battery_energy_mwh = 0;
+
+// Owned by the power management task, the only one switching the profile
+static bool _mains_lost_latched = false;
+static uint64_t _mains_lost_millis = 0;
+static uint32_t _inputs_sequence = 0;
+
+static void power_management_ups_apply_cpu_policy(const power_management_ups_profile_t * profile) {
+#if CONFIG_PM_ENABLE
+    if (!profile->cpu_max_freq_mhz) {
+        return;
+    }
+
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = profile->cpu_max_freq_mhz,
+        .min_freq_mhz = profile->cpu_min_freq_mhz ? profile->cpu_min_freq_mhz : profile->cpu_max_freq_mhz,
+        .light_sleep_enable = profile->cpu_light_sleep,
+    };
+
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot apply CPU policy %d-%d MHz: %s", pm_config.min_freq_mhz, pm_config.max_freq_mhz, esp_err_to_name(err));
+    }
+#endif
+}
+
+uint32_t power_management_ups_hold_up_time_s() {
+    uint32_t average_power_mw = _profiles[POWER_MANAGEMENT_UPS_PROFILE_BATTERY].average_power_mw;
+
+    if (!_ups_started || !average_power_mw) {
+        return 0;
+    }
+
+    return (uint64_t)_battery_energy_mwh * 3600 / average_power_mw;
+}
+
+static void power_management_ups_switch(power_management_ups_profile_id_t profile) {
+    if (profile == _profile) {
+        return;
+    }
+
+    _profile = profile;
+    power_management_ups_apply_cpu_policy(&_profiles[profile]);
+
+    power_management_ups_profile_change_t change = {
+        .profile = profile,
+        .hold_up_time_s = power_management_ups_hold_up_time_s(),
+    };
+
+    ESP_LOGI(
+            TAG,
+            "Switched to %s profile, hold-up time %" PRIu32 " s",
+            power_management_ups_profile_to_str(profile),
+            change.hold_up_time_s
+        );
+    power_management_emit_event(POWER_MANAGEMENT_EVENT_UPS_PROFILE_CHANGED, &change, sizeof(change));
+}
+
+esp_err_t power_management_ups_init(const power_management_ups_profile_t profiles[POWER_MANAGEMENT_UPS_PROFILE_MAX]) {
+    power_management_inputs_t inputs;
+
+    if (!profiles) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (_ups_started || power_management_inputs_get(&inputs) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (int i = 0; i < POWER_MANAGEMENT_UPS_PROFILE_MAX; i++) {
+        if (profiles[i].idle_timeout_ms && profiles[i].idle_timeout_ms < POWER_MANAGEMENT_IDLE_TIMEOUT_MIN_MS) {
+            ESP_LOGE(
+                    TAG,
+                    "The idle timeout of %s profile is too small: %" PRIu64,
+                    power_management_ups_profile_to_str((power_management_ups_profile_id_t)i),
+                    profiles[i].idle_timeout_ms
+                );
+            return ESP_ERR_INVALID_ARG;
+        }
+        _profiles[i] = profiles[i];
+    }
+
+    _ups_started = true;
+
+    // The initial profile is switched to by the power management task on the fresh sample
+    power_management_inputs_sample_request();
+    power_management_priv_wake();
+
+    return ESP_OK;
+}
+
+esp_err_t power_management_ups_mains_lost() {
+    if (!_ups_started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    _mains_lost_pending = true;
+    power_management_inputs_sample_request();
+    power_management_priv_wake();
+
+    return ESP_OK;
+}
+
+esp_err_t power_management_ups_mains_lost_from_isr(BaseType_t * task_unblocked) {
+    if (!_ups_started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    _mains_lost_pending = true;
+    power_management_inputs_sample_request_from_isr(task_unblocked);
+    power_management_priv_wake_from_isr(task_unblocked);
+
+    return ESP_OK;
+}
+
+void power_management_ups_set_battery_energy(uint32_t energy_mwh) {
+    _battery_energy_mwh = energy_mwh;
+}
+
+power_management_ups_profile_id_t power_management_ups_get_profile() {
+    power_management_ups_profile_id_t profile = _profile;
+    return profile < POWER_MANAGEMENT_UPS_PROFILE_MAX ? profile : POWER_MANAGEMENT_UPS_PROFILE_MAINS;
+}
+
+void power_management_priv_ups_inputs(const power_management_inputs_t * inputs) {
+    power_management_ups_profile_id_t profile = inputs->charger_connected ?
+                                                POWER_MANAGEMENT_UPS_PROFILE_MAINS :
+                                                POWER_MANAGEMENT_UPS_PROFILE_BATTERY;
+
+    // Sampled by the button task, the switch is left to the power management task
+    if (_ups_started && profile != _profile) {
+        power_management_priv_wake();
+    }
+}
+
+void power_management_priv_ups_poll() {
+    power_management_inputs_t inputs;
+
+    if (!_ups_started) {
+        return;
+    }
+
+    if (_mains_lost_pending) {
+        _mains_lost_pending = false;
+        // The power-fail interrupt comes ahead of the charger input drop, and the samples taken until then
+        // still read the charger connected, so MAINS is not restored until the charger is seen disconnected
+        // or still reads connected after the hold time, e.g. after a short mains dip
+        _mains_lost_latched = true;
+        _mains_lost_millis = power_management_millis();
+        power_management_ups_switch(POWER_MANAGEMENT_UPS_PROFILE_BATTERY);
+    }
+
+    if (power_management_inputs_get(&inputs) != ESP_OK || inputs.sequence == _inputs_sequence) {
+        return;
+    }
+
+    _inputs_sequence = inputs.sequence;
+
+    if (!inputs.charger_connected) {
+        _mains_lost_latched = false;
+        power_management_ups_switch(POWER_MANAGEMENT_UPS_PROFILE_BATTERY);
+        return;
+    }
+
+    if (_mains_lost_latched && inputs.timestamp_ms >= _mains_lost_millis + POWER_MANAGEMENT_UPS_MAINS_LOST_HOLD_MS) {
+        _mains_lost_latched = false;
+    }
+
+    if (!_mains_lost_latched) {
+        power_management_ups_switch(POWER_MANAGEMENT_UPS_PROFILE_MAINS);
+    }
+}
+
+bool power_management_priv_ups_idle(uint64_t * timeout_ms, power_management_idle_timer_expired_action_t * action) {
+    power_management_ups_profile_id_t profile = _profile;
+
+    if (!_ups_started || profile >= POWER_MANAGEMENT_UPS_PROFILE_MAX || !_profiles[profile].idle_timeout_ms) {
+        return false;
+    }
+
+    *timeout_ms = _profiles[profile].idle_timeout_ms;
+    *action = _profiles[profile].idle_action;
+
+    return true;
+}
+
+uint32_t power_management_priv_ups_pmic_loop_period_ms() {
+    power_management_ups_profile_id_t profile = _profile;
+
+    if (!_ups_started || profile >= POWER_MANAGEMENT_UPS_PROFILE_MAX) {
+        return 0;
+    }
+
+    return _profiles[profile].pmic_loop_period_ms;
+}
@@ -0,0 +1,210 @@
+#ifndef POWER_MANAGEMENT_PRIV_H
+#define POWER_MANAGEMENT_PRIV_H
+
+#include "power_management_defs.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/**
+ * The internal interface between power management daemon and its modules.
+ * Not intended to be used by the application.
+ */
+
+/**
+ * @brief Calls the shutdown callback set by the application
+ * 
+ * @return ESP_ERR_INVALID_STATE if the shutdown callback is not set yet
+ */
+esp_err_t power_management_priv_call_shutdown_cb();
+
+/**
+ * @brief Stops the power management tasks, so they do not interfere with the emergency shutdown
+ * 
+ * The tasks stop themselves at the points holding no lock (inputs, NVS, event loop, application callbacks),
+ * they are never suspended from outside.
+ * 
+ * @return false if some task is not stopped within the timeout and is still running
+ */
+bool power_management_priv_stop_tasks(uint32_t timeout_ms);
+
+/**
+ * @brief Stops the calling power management task if the stop is requested
+ * 
+ * Must be called only at the points holding no lock.
+ */
+void power_management_priv_stop_point();
+
+/**
+ * @brief Get the idle action of the active UPS profile or of the runtime settings
+ */
+power_management_idle_timer_expired_action_t power_management_priv_idle_action();
+
+/**
+ * @brief Sets the state the power management daemon starts from, INIT by default, called before power_management_init()
+ */
+void power_management_priv_initial_state_set(power_management_state_t state);
+
+/**
+ * @brief Wakes the power management task up from the delay or the loop pause
+ */
+void power_management_priv_wake();
+void power_management_priv_wake_from_isr(BaseType_t * task_unblocked);
+
+/**
+ * @brief Wakes the button task up from the loop pause, so it samples the inputs at once
+ */
+void power_management_priv_button_wake();
+void power_management_priv_button_wake_from_isr(BaseType_t * task_unblocked);
+
+/**
+ * @brief Saves the jobs schedule along with the RTC time before the sleep, so it's restored at the next start
+ */
+void power_management_priv_jobs_save();
+
+/**
+ * @brief Checks if the device is woken up from the deep sleep by the timer armed for the periodic jobs
+ * 
+ * @return true only once, at the first setup after such a wake-up
+ */
+bool power_management_priv_jobs_woken_up();
+
+/**
+ * @brief Creates the emergency shutdown task, called from power_management_init()
+ */
+void power_management_priv_emergency_init();
+
+/**
+ * @brief Loads the runtime settings from NVS, called from power_management_init()
+ */
+void power_management_priv_settings_init();
+
+/**
+ * @brief Checks that the timeouts are not below the minimal ones and the button thresholds are ordered
+ */
+bool power_management_priv_settings_valid(const power_management_settings_t * settings);
+
+/**
+ * @brief Get the cached runtime settings
+ */
+const power_management_settings_t * power_management_priv_settings();
+
+/**
+ * @brief Applies the runtime settings to the cache and marks them to be written
+ * 
+ * @return ESP_ERR_INVALID_ARG if the settings are inconsistent, the cache is not changed then
+ */
+esp_err_t power_management_priv_settings_apply(const power_management_settings_t * settings, uint64_t now_millis);
+
+/**
+ * @brief Writes the changed settings if they were not changed for the quiet period
+ */
+void power_management_priv_settings_flush_if_quiet(uint64_t now_millis);
+
+/**
+ * @brief Checks that either the inputs callback or all the separate input callbacks are set
+ */
+bool power_management_priv_inputs_ready();
+
+/**
+ * @brief Creates the inputs snapshot lock, called from power_management_init()
+ */
+void power_management_priv_inputs_init();
+
+/**
+ * @brief Get the inputs snapshot, sampling the inputs if the snapshot is older than the sample period
+ */
+void power_management_priv_inputs_get(power_management_inputs_t * inputs);
+
+/**
+ * @brief Checks that the event has the mask subscribers, so it's worth posting
+ */
+bool power_management_priv_subscribed(power_management_event_t event);
+
+/**
+ * @brief Registers the esp_event dispatcher of the subscriptions, called from power_management_init()
+ */
+void power_management_priv_subscriptions_init();
+
+/**
+ * @brief Creates the callbacks worker task if it's enabled, called from power_management_init()
+ */
+void power_management_priv_callbacks_init();
+
+/**
+ * @brief Calls the application callback within its budget, inline or by the worker according to its policy
+ * 
+ * The call is skipped if the previous call of the same callback is still run by the worker.
+ */
+void power_management_priv_callback_run(power_management_callback_t callback, void (*cb)());
+
+/**
+ * @brief Waits for the callback run by the worker to finish, before the device goes to sleep/shutdown/reboot
+ */
+void power_management_priv_callbacks_drain();
+
+/**
+ * @brief Wakes the callbacks worker task to reach its stop point
+ * 
+ * @return the number of the worker tasks to wait for
+ */
+int power_management_priv_callbacks_stop();
+
+/**
+ * @brief Fills the callbacks overruns and durations of the statistics
+ */
+void power_management_priv_callbacks_stats_get(power_management_stats_t * stats);
+
+/**
+ * @brief Records the sampled inputs if they changed and the recording is started
+ */
+void power_management_priv_trace_inputs(const power_management_inputs_t * inputs);
+
+/**
+ * @brief Records the request handled by the daemon if the recording is started
+ */
+void power_management_priv_trace_request(const power_management_request_t * req);
+
+/**
+ * @brief Records the event emitted by the application if the recording is started
+ */
+void power_management_priv_trace_event(power_management_event_t event, const void * data, size_t data_size);
+
+/**
+ * @brief Adds the state transition to the replay timeline and residency, Linux target only
+ */
+void power_management_priv_replay_state_changed(power_management_state_t from, power_management_state_t to);
+
+/**
+ * @brief Releases the active lock acquired by the owner task, called only from the power management task
+ */
+void power_management_priv_active_lock_drop(TaskHandle_t owner);
+
+/**
+ * @brief Releases the active locks of the expired network operations, called from the power management task
+ */
+void power_management_priv_radio_poll(uint64_t now_millis);
+
+/**
+ * @brief Wakes the power management task up if the sampled charger input differs from the UPS profile
+ */
+void power_management_priv_ups_inputs(const power_management_inputs_t * inputs);
+
+/**
+ * @brief Switches the UPS profile by the mains loss signal and the charger input, called only from the power management task
+ */
+void power_management_priv_ups_poll();
+
+/**
+ * @brief Get the idle timeout and action of the active UPS profile
+ * 
+ * @return false if the UPS mode is not started or the profile uses the runtime settings
+ */
+bool power_management_priv_ups_idle(uint64_t * timeout_ms, power_management_idle_timer_expired_action_t * action);
+
+/**
+ * @brief Get the PMIC loop period of the active UPS profile, 0 - every loop
+ */
+uint32_t power_management_priv_ups_pmic_loop_period_ms();
+
+#endif // POWER_MANAGEMENT_PRIV_H